@@ -20,25 +20,102 @@ constants.h
 // asynchronous execution (in microseconds)
 #define LOOP_SLEEP_TIME_US 50000
 
-// Largest allowable packet size of packet payload
+// Largest allowable packet size of packet payload, i.e. the largest MTU a
+// link can be configured with. Every packet a node holds has room for this
+// much, so it is kept small by default; the wire header carries the length in
+// 16 bits, so it can be raised at build time up to 65535 for jumbo links.
+#ifndef PACKET_PAYLOAD_MAX
 #define PACKET_PAYLOAD_MAX 100
+#endif
 
-// Number of wait cycles a typical packet is assigned
-// (Not necessarily tied to a measure of time)
-#define TIMETOLIVE 200
+// Bytes in front of every payload on the wire: 32-bit src and dst node ids,
+// type, hop count and a 16-bit payload length, all big-endian
+#define PACKET_HEADER_SIZE 12
 
+// Most switches a packet may cross; a switch drops a packet that has crossed
+// this many, so one caught in a loop while routes change does not circle on
+#define PACKET_MAX_HOPS 64
+
+// Destination of packets meant for every neighbour, such as STP control
+// packets. Node ids are never negative.
+#define BROADCAST_ID -1
+
+// MTU (largest payload per packet) of a link whose config line sets none.
+// Control and DNS messages assume at least this much.
+#define DEFAULT_LINK_MTU 100
+
+// Initial size of a pipe port's receive stream buffer; one read() fills as
+// much of it as the pipe holds
+#define PACKET_STREAM_BUFFER 4096
+
+// Most packets a port collects before writing them out together. Pipe
+// batches are also kept within one atomic pipe write (PIPE_BUF).
+#ifndef PACKET_TX_BATCH_MAX
+#define PACKET_TX_BATCH_MAX 32
+#endif
+
+// Longest a packet waits in a port's batch while the node keeps working (in
+// milliseconds); 0 sends every packet at once
+#ifndef PACKET_TX_FLUSH_MS
+#define PACKET_TX_FLUSH_MS 5
+#endif
+
+// Size of a port's output batch: a full pipe write (4096 bytes), or a single
+// maximum size packet if that is larger
+#define PACKET_TX_BATCH_BYTES                        \
+  ((PACKET_HEADER_SIZE + PACKET_PAYLOAD_MAX > 4096) \
+       ? PACKET_HEADER_SIZE + PACKET_PAYLOAD_MAX    \
+       : 4096)
+
+// Range of the wait before reconnecting a SOCKET link whose connection
+// failed; it doubles with every failed attempt (in milliseconds)
+#define SOCKET_BACKOFF_MIN_MS 50
+#define SOCKET_BACKOFF_MAX_MS 5000
+
+// Most output bytes a port queues while its link takes them slower than they
+// are sent (or a SOCKET link is still connecting); beyond that, the port's
+// queue policy decides which packets are dropped
+#ifndef PORT_QUEUE_BYTES
+#define PORT_QUEUE_BYTES 65536
+#endif
+
+// A port with the RED queue policy drops no packets while its average queue
+// depth is below RED_MIN_BYTES and every packet above RED_MAX_BYTES; in
+// between, the drop probability rises linearly to 1 in RED_MAX_P_INV
+#define RED_MIN_BYTES (PORT_QUEUE_BYTES / 4)
+#define RED_MAX_BYTES (3 * (PORT_QUEUE_BYTES / 4))
+#define RED_MAX_P_INV 10
+
+// How long a request waits for its response (in milliseconds)
+#define RESPONSE_TIMEOUT_MS 10000
+
+// Period of a host's timer tick, which is also the resolution of its
+// response timeouts (in milliseconds)
+#define HOST_TICK_MS 50
+
+// Maximum number of jobs a host runs per wakeup before it services its
+// ports and manager pipe again
+#define HOST_JOB_BUDGET 64
+
+// Id of the DNS server when the configuration file does not list one
 #define STATIC_DNS_ID 100
 
 // The number of payload space available after including
 // a job id, the ':' delimiter, and a null terminator
 #define MAX_RESPONSE_LEN (PACKET_PAYLOAD_MAX - 2 - JIDLEN)
 
-// Maximum length that a domain name can have
-#define MAX_NAME_LEN (MAX_RESPONSE_LEN - 4)
+// Maximum length that a domain name can have; names travel in DNS packets
+// that must fit a DEFAULT_LINK_MTU link
+#define MAX_NAME_LEN (DEFAULT_LINK_MTU - 2 - JIDLEN - 4)
 
-// Maximum number of allowable Domain Name aliases
-#define MAX_NUM_NAMES 255
+// Nodes send a STP keepalive on every port this often (in milliseconds);
+// changes to the spanning tree are sent as soon as they happen
+#define STP_HELLO_MS 2000
 
-#define PERIODIC_CTRL_MSG_WAITTIME_MS 500
+// A switch takes a neighbor it has not heard from for this long as lost and
+// rebuilds the spanning tree without it (in milliseconds)
+#define STP_HOLD_MS (3 * STP_HELLO_MS + STP_HELLO_MS / 2)
 
-#define ALLOWED_CONVERGENCE_ROUNDS 10
+// Root distance at which a switch ignores its neighbors' offers, which bounds
+// how long a root that was cut off keeps being passed around a loop
+#define STP_MAX_DIST 64
@@ -23,6 +23,7 @@
 #define SWITCH_DEBUG_CONTROL_UPDATE
 // #define SWITCH_DEBUG_ROUTINGTABLE
 #define SWITCH_DEBUG_PACKET_RECEIPT
+#define SWITCH_DEBUG_QUEUE
 
 // #define NAMESERVER_DEBUG
 #define NAMESERVER_DEBUG_PACKET_RECEIPT
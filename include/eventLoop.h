@@ -0,0 +1,98 @@
+/*
+    eventLoop.h
+    readiness-driven wait for a node's ports, manager pipe and timer
+*/
+
+#pragma once
+
+struct Net_port;
+struct Uring;
+
+// Maximum number of readiness events returned by one event_loop_wait()
+#define EVENT_LOOP_MAX_EVENTS 64
+
+/* Sources an event loop can report readiness for */
+enum EventKind {
+  EVENT_PORT,     // A network link port has data to receive
+  EVENT_MANAGER,  // The manager pipe has a command
+  EVENT_TIMER     // The node's periodic timer fired
+};
+
+struct Event {
+  enum EventKind kind;
+  int index;  // Port number for EVENT_PORT, otherwise 0
+};
+
+struct EventLoop {
+  int epfd;
+  int timerfd;
+
+  // Timer state used instead of the timerfd in virtual-time mode
+  long long timerDeadline;
+  int timerIntervalMs;
+  unsigned int timerGeneration;  // Bumped on every re-arm to retire old entries
+  int timerDue;
+  void *owner;  // Set by the scheduler to the task driving this loop
+
+  struct Uring *ring;  // Pipe ports go through this ring when io_uring is on
+};
+
+/* Creates the epoll instance and the (disarmed) timerfd of an event loop.
+ * Returns 0 on success, -1 on failure. */
+int event_loop_init(struct EventLoop *el);
+
+/* Registers fd for read readiness, reported back as {kind, index}. */
+int event_loop_add_fd(struct EventLoop *el, int fd, enum EventKind kind,
+                      int index);
+
+/* Stops reporting fd, which was registered with event_loop_add_fd(). */
+void event_loop_remove_fd(struct EventLoop *el, int fd);
+
+/* Registers a link port, reported back as {EVENT_PORT, index}. With io_uring
+ * enabled, pipe ports are read by the loop's ring instead of being polled. */
+int event_loop_add_port(struct EventLoop *el, struct Net_port *port,
+                        int index);
+
+/* Starts (enable 1) or stops (enable 0) reporting fd as {EVENT_PORT, index}
+ * while it is writable. Used by socket ports with output the kernel could
+ * not take yet. Returns 0 on success, -1 on failure. */
+int event_loop_watch_write(struct EventLoop *el, int fd, int index,
+                           int enable);
+
+/* Issues the packet writes queued on the loop's ring since the last flush.
+ * Nodes call this at the end of every step. */
+void event_loop_flush(struct EventLoop *el);
+
+/* Returns 1 if the loop holds port events that the last wait had no room
+ * for, so the node must not block. */
+int event_loop_pending(struct EventLoop *el);
+
+/* Arms the timer to first fire after initialMs, then every intervalMs
+ * (intervalMs of 0 makes it one-shot). */
+void event_loop_arm_timer(struct EventLoop *el, int initialMs, int intervalMs);
+
+void event_loop_disarm_timer(struct EventLoop *el);
+
+/* Blocks for at most timeoutMs (-1 blocks indefinitely, 0 polls) until any
+ * registered source is ready. Fills events[] and returns how many were
+ * written, 0 on timeout, or -1 on error. Timer expirations are consumed
+ * here so the caller only sees one EVENT_TIMER per wait. */
+int event_loop_wait(struct EventLoop *el, struct Event *events, int maxEvents,
+                    int timeoutMs);
+
+/* Switches every event loop to a simulated clock. Must be called before any
+ * event loop is created. Timers are then kept in one global priority queue
+ * and only fire when the clock is moved with
+ * event_loop_advance_virtual_time(). */
+void event_loop_use_virtual_time();
+
+/* Returns 1 in virtual-time mode, 0 otherwise. */
+int event_loop_virtual_time();
+
+/* Returns the simulated clock in milliseconds. */
+long long event_loop_virtual_now_ms();
+
+/* Jumps the simulated clock to the earliest armed timer and marks every loop
+ * whose timer fires at that instant as due, storing up to maxDue of them in
+ * due[]. Returns how many were stored, 0 if no timer is armed. */
+int event_loop_advance_virtual_time(struct EventLoop **due, int maxDue);
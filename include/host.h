@@ -4,4 +4,13 @@
 
 #pragma once
 
-void host_main(int host_id);
\ No newline at end of file
+struct NodeTask;
+
+void host_main(int host_id);
+
+/* Runs one wakeup of a host without blocking longer than timeoutMs. Returns 1
+ * if the host still has runnable jobs queued. */
+int host_step(void *context, int timeoutMs);
+
+/* Sets up a host as a task for the threaded scheduler. */
+void host_task_init(struct NodeTask *task, int host_id);
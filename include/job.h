@@ -10,8 +10,6 @@
 
 enum JobType {
   JOB_SEND_PKT,
-  JOB_BROADCAST_PKT,
-  JOB_FORWARD_PKT,
   JOB_SEND_REQUEST,
   JOB_SEND_RESPONSE,
   JOB_WAIT_FOR_RESPONSE,
@@ -37,9 +35,11 @@ struct JobQueue {
 };
 
 struct Job {
-  char jid[JIDLEN];
+  char jid[JIDLEN + 1];
   char errorMsg[MAX_MSG_LENGTH];
-  int timeToLive;
+  long long deadline;  // Wall-clock time (ms) at which a waiting job expires
+  long long timerTick;  // Wheel tick the deadline falls on
+  int timerSlot;        // Slot holding the job in a TimerWheel, -1 if none
   FILE *fp;
   char filepath[MAX_FILENAME_LENGTH * 2];
   long fileOffset;
@@ -47,6 +47,32 @@ struct Job {
   enum JobState state;
   struct Packet *packet;
   struct Job *next;
+  struct Job *prev;  // Only used while the job is held by a TimerWheel
+  struct Job *indexNext;  // Next job in the same TimerWheel index bucket
+};
+
+// Number of slots on each level of a TimerWheel (a power of two)
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+// Number of levels of a TimerWheel. A slot on level n spans a full turn of
+// level n - 1, so three levels of 64 slots cover 64^3 ticks.
+#define TIMER_WHEEL_LEVELS 3
+
+// Number of buckets in a TimerWheel's job ID index (a power of two)
+#define TIMER_WHEEL_INDEX_SIZE 64
+
+/* Hierarchical timer wheel holding jobs until their deadline passes. Jobs
+ * waiting on a response are parked here instead of cycling through the
+ * JobQueue, so the cost of waiting does not grow with the number of
+ * outstanding requests. */
+struct TimerWheel {
+  struct Job *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  struct Job *index[TIMER_WHEEL_INDEX_SIZE];  // Jobs hashed by their ID
+  long long startMs;      // Wall-clock time of tick 0
+  long long currentTick;  // Last tick whose jobs have been expired
+  int tickMs;
+  int occ;
 };
 
 /* Takes an enumeration value representing a job type and returns the
@@ -63,8 +89,8 @@ void job_enqueue(int host_id, struct JobQueue *jq, struct Job *j);
 /* Removes the first job from a job queue and returns it.*/
 struct Job *job_dequeue(int host_id, struct JobQueue *j_q);
 
-struct Job *job_create(const char *jid, int timeToLive, enum JobType type,
-                       enum JobState state, struct Packet *packet);
+struct Job *job_create(const char *jid, enum JobType type, enum JobState state,
+                       struct Packet *packet);
 
 /* Allocates memory for a new job, initializes its fields with default
  * values, and returns a pointer to it.*/
@@ -86,4 +112,27 @@ int job_queue_length(struct JobQueue *jq);
 
 struct Job *job_queue_find_id(struct JobQueue *jq, char findjid[JIDLEN]);
 
-int job_queue_delete_id(struct JobQueue *jq, const char *deljid);
\ No newline at end of file
+int job_queue_delete_id(struct JobQueue *jq, const char *deljid);
+
+/* Initializes an empty timer wheel whose ticks are tickMs long, starting at
+ * wall-clock time nowMs. */
+void timer_wheel_init(struct TimerWheel *tw, long long nowMs, int tickMs);
+
+/* Parks job j in the wheel until deadlineMs. Deadlines are rounded up to the
+ * next tick, so a job never expires early. */
+void timer_wheel_add(struct TimerWheel *tw, struct Job *j, long long deadlineMs);
+
+/* Takes job j back out of the wheel before its deadline. */
+void timer_wheel_remove(struct TimerWheel *tw, struct Job *j);
+
+/* Advances the wheel to wall-clock time nowMs and moves every job whose
+ * deadline has passed onto the expired queue. Returns the number of jobs
+ * that expired. */
+int timer_wheel_advance(struct TimerWheel *tw, long long nowMs,
+                        struct JobQueue *expired);
+
+/* Returns the number of jobs held by a timer wheel. */
+int timer_wheel_length(struct TimerWheel *tw);
+
+/* Returns the job with a matching ID held by a timer wheel, or NULL. */
+struct Job *timer_wheel_find_id(struct TimerWheel *tw, const char *findjid);
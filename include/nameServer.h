@@ -8,7 +8,39 @@
 // Forward declarations
 struct Net_port;
 struct Job;
+struct NodeTask;
 
-void init_nametable(char **nametable);
+// Buckets a nametable starts with; it doubles whenever it holds twice as
+// many names
+#define NAMETABLE_INITIAL_BUCKETS 64
 
-void name_server_main(int switch_id);
\ No newline at end of file
+struct NameEntry;
+
+/* Domain names registered to node ids. Node ids are 32-bit, so names are kept
+ * in a hash table keyed by id rather than in an array indexed by it. */
+struct NameTable {
+  struct NameEntry **buckets;
+  int numBuckets;
+  int numNames;
+};
+
+void init_nametable(struct NameTable *table);
+
+/* Returns the name registered to id, or NULL if it has none. */
+const char *nametable_get(struct NameTable *table, int id);
+
+/* Registers name (truncated to MAX_NAME_LEN) to id, replacing its old name.
+ * Negative ids are ignored. */
+void nametable_set(struct NameTable *table, int id, const char *name);
+
+/* Returns the lowest id that name is registered to, or -1 if it has none. */
+int nametable_find(struct NameTable *table, const char *name);
+
+void name_server_main(int switch_id);
+
+/* Runs one wakeup of the name server without blocking longer than timeoutMs.
+ * Returns 1 if the name server still has jobs queued. */
+int name_server_step(void *context, int timeoutMs);
+
+/* Sets up the name server as a task for the threaded scheduler. */
+void name_server_task_init(struct NodeTask *task, int name_id);
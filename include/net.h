@@ -4,6 +4,10 @@
 
 #include "constants.h"
 
+struct Uring;
+struct ShmRing;
+struct EventLoop;
+
 #define PIPE_READ 0
 #define PIPE_WRITE 1
 
@@ -15,7 +19,28 @@ enum NetNodeType { /* Types of network nodes */
 
 enum NetLinkType { /* Types of network links */
                    PIPE,
-                   SOCKET
+                   SOCKET,
+                   UDP,
+                   SHM,
+                   LOCAL
+};
+
+enum QueuePolicy { /* What a port drops once its output queue fills up */
+                   QUEUE_TAIL_DROP, // The packets being sent
+                   QUEUE_HEAD_DROP, // The packets that waited longest
+                   QUEUE_RED        // Random early detection: packets being
+                                    // sent, more often as the queue grows
+};
+
+/* Counters of a port's output queue, in packets unless noted */
+struct PortQueueStats {
+  unsigned long long enqueued;    // Accepted into the queue
+  unsigned long long tailDrops;   // Refused because the queue was full
+  unsigned long long headDrops;   // Dropped from the front to make room
+  unsigned long long earlyDrops;  // Refused early by RED
+  unsigned long long linkDrops;   // Lost with a failed or absent connection
+  unsigned long long mtuDrops;    // Larger than the link's MTU
+  int maxDepth;                   // Most bytes queued at once
 };
 
 struct Net_node { /* Network node, e.g., host or switch */
@@ -36,6 +61,8 @@ struct Net_link {
   int socket_local_port;
   char socket_remote_domain[MAX_DOMAIN_NAME_LENGTH];
   int socket_remote_port;
+  int mtu;
+  enum QueuePolicy queuePolicy;
 };
 
 struct Net_port {
@@ -46,6 +73,46 @@ struct Net_port {
   char localDomain[MAX_DOMAIN_NAME_LENGTH];
   char remoteDomain[MAX_DOMAIN_NAME_LENGTH];
   int remotePort;
+  // SOCKET and LOCAL links send on a connection to the remote node (send_fd)
+  // and receive on the connection it opened to listen_fd (recv_fd); both are
+  // -1 while not connected. LOCAL links keep their socket paths in
+  // localDomain and remoteDomain.
+  int listen_fd;
+  int sockConnecting;     // send_fd has a connect() in progress
+  long long sockRetryMs;  // No reconnect is attempted before this time
+  int sockBackoffMs;      // Wait before the next attempt if it fails too
+  struct EventLoop *loop;  // Loop watching the port, told of new connections
+  int loopIndex;
+  int mtu;  // Largest payload sent in one packet on this link
+  // SHM links send into one shared ring and receive from the other; recv_fd
+  // is the receive ring's eventfd
+  struct ShmRing *shmTx;
+  struct ShmRing *shmRx;
+  struct Uring *ring;  // Set when the port is read and written via io_uring
+  int ringIndex;
+  // Bytes received on a pipe that do not yet form a whole packet
+  char *rxBuf;
+  int rxStart;
+  int rxLen;
+  int rxCapacity;
+  // Output queue: outLen bytes of packets at outBuf + outStart that the link
+  // has not taken yet, the first outFrameLeft of them ending a packet that
+  // was partly written and the first outInFlight of them in an io_uring
+  // write that has not completed. The last txCount packets (txLen bytes) were
+  // sent since the last packet_flush().
+  char *outBuf;
+  int outStart;
+  int outLen;
+  int outFrameLeft;
+  int outInFlight;
+  int outWatchWrite;  // send_fd is in the event loop until it is writable
+  int txLen;
+  int txCount;
+  long long txFirstMs;
+  enum QueuePolicy queuePolicy;
+  int redAvgDepth;  // Average queue depth in bytes, as seen by RED
+  unsigned int redSeed;
+  struct PortQueueStats queueStats;
   struct Net_port *next;
 };
 
@@ -55,8 +122,21 @@ struct Man_port_at_host *net_get_host_port(int host_id);
 
 struct Net_node *net_get_node_list();
 
+/* Returns the id of the DNS server in the configuration file, or
+ * STATIC_DNS_ID if it has none. */
+int net_get_dns_id();
+
+/* Returns the smallest MTU of any link in the configuration file. Switches do
+ * not split packets, so this is the largest payload every path carries. */
+int net_get_min_mtu();
+
 struct Net_port *net_get_port_list(int host_id);
 
+/* Returns the file descriptor that becomes readable when port has incoming
+ * data: the pipe's read end, or the listening socket of a SOCKET or LOCAL
+ * link (whose accepted connection is added to the port's event loop later). */
+int net_port_recv_fd(struct Net_port *port);
+
 int net_init();
 
 /*
@@ -95,5 +175,5 @@ int load_net_data_file();
 /* Creates a data structure for the nodes */
 void create_node_list();
 
-/* Creates links, using pipes, then creates a port list for these links */
+/* Creates links, using pipes, shared memory rings or sockets, then creates a port list for these links */
 void create_port_list();
@@ -22,29 +22,79 @@ typedef enum {
   PKT_DNS_QUERY,
   PKT_DNS_QUERY_RESPONSE,
   PKT_DNS_REGISTRATION,
-  PKT_DNS_REGISTRATION_RESPONSE
+  PKT_DNS_REGISTRATION_RESPONSE,
+  PKT_ROUTE  // Distance vector between neighbor switches in ECMP mode
 } packet_type;
 
+struct PacketPool;
+
 struct Packet {
-  char src;
-  char dst;
+  int src;  // Node ids are 32-bit on the wire
+  int dst;
   char type;
+  unsigned char hops;  // Switches the packet has crossed
   int length;
-  char payload[PACKET_PAYLOAD_MAX];
+  char payload[PACKET_PAYLOAD_MAX + 1];  // Room to terminate string payloads
+  struct PacketPool *pool;  // Pool the packet returns to, NULL if malloc'd
+  struct Packet *nextFree;  // Link in the pool's free list
+};
+
+// Number of packets a packet pool allocates at once when it runs dry
+#define PACKET_POOL_SLAB 64
+
+/* Free list of packets owned by one node. Packets taken from the pool go back
+ * to it on packet_delete(), so a node that keeps receiving only allocates
+ * until its pool covers the packets it holds at once. A pool is only used by
+ * the node that owns it. */
+struct PacketPool {
+  struct Packet *freeList;
+  int numFree;
+  int numInUse;
 };
 
 // Forward declaration, defined in net.h
 struct Net_port;
 
+/* Receives the next packet on port into p. Pipe, shared memory and socket
+ * links are byte streams: every read takes all that has arrived and packets are decoded out
+ * of the port's stream buffer, so each call after the first usually needs no
+ * system call. Returns the packet's size on the wire, 0 if no whole packet has
+ * arrived, or -1 if the port could not be read. */
 int packet_recv(struct Net_port *port, struct Packet *p);
 
+/* Appends len bytes received on a pipe port to its stream buffer. */
+void packet_stream_append(struct Net_port *port, const char *buf, int len);
+
+/* Adds p to port's output batch, or drops it (counting an MTU drop) if its
+ * payload exceeds the port's MTU. The batch goes out as a single write once it holds
+ * PACKET_TX_BATCH_MAX packets, once
+ * its oldest packet has waited PACKET_TX_FLUSH_MS, or at the next
+ * packet_flush(). */
 void packet_send(struct Net_port *port, struct Packet *p);
 
+/* Takes the result of an io_uring write of port's queue: res bytes were
+ * written, or res is a negative errno. Written bytes leave the queue; when
+ * the pipe was full, the rest stays queued until it has room again. */
+void packet_write_done(struct Net_port *port, int res);
+
+/* Writes out the output batches of numPorts ports. Nodes call this at the end
+ * of every step. */
+void packet_flush(struct Net_port **ports, int numPorts);
+
+/* Returns 1 if a whole packet is already buffered on port, 0 otherwise. */
+int packet_pending(struct Net_port *port);
+
 struct Packet *createPacket(int src, int dst, int type, int length,
                             char *payload);
 
 struct Packet *createEmptyPacket();
 
+void packet_pool_init(struct PacketPool *pool);
+
+/* Takes a packet from pool with its header fields cleared. The payload is not
+ * cleared; packet_recv() terminates what it reads. */
+struct Packet *packet_pool_get(struct PacketPool *pool);
+
 struct Packet *deepcopy_packet(const struct Packet *original);
 
 void packet_delete(struct Packet *p);
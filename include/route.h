@@ -0,0 +1,64 @@
+/*
+    route.h
+    shortest-path routes of a switch in equal-cost multipath (ECMP) mode,
+    learned from the distance vectors of its neighbor switches
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+// Distance at which a node counts as unreachable; it also bounds how long the
+// routes to a lost node keep counting up around a loop
+#define ROUTE_MAX_DIST 64
+
+// Distance advertised for a node that cannot be reached
+#define ROUTE_UNREACHABLE 255
+
+// Bytes one route takes in a PKT_ROUTE payload: node id, then distance
+#define ROUTE_ENTRY_SIZE 5
+
+/* Routes of one switch. For every node a route was heard for, it keeps the
+ * distance each port's neighbor advertised, so all the ports on a shortest
+ * path are known at once. Routes are never removed; a lost node is advertised
+ * as unreachable instead. */
+struct RouteTable {
+  int numPorts;
+  int *portNode;    // Endpoint on each port, -1 if none
+  uint8_t *portUp;  // 1 while a neighbor switch is heard on the port
+  int numRoutes;
+  int capacity;      // Routes the arrays below have room for
+  int *dst;          // Node id of each route
+  uint8_t *dist;     // Shortest distance of each route
+  uint8_t *viaDist;  // numPorts advertised distances per route
+  int *slots;        // Route of each hash slot, -1 if free
+};
+
+void route_table_init(struct RouteTable *table, int numPorts);
+
+/* Records what is on port: endpoint endpointId (or -1), or a neighbor switch
+ * if isSwitch. up is 0 once the neighbor is lost, which forgets what it
+ * advertised. */
+void route_set_port(struct RouteTable *table, int port, int isSwitch,
+                    int endpointId, int up);
+
+/* Takes in the distances a neighbor advertised on port in a PKT_ROUTE
+ * payload. */
+void route_receive(struct RouteTable *table, int port, const char *payload,
+                   int length);
+
+/* Recomputes every route's distance. Returns 1 if any changed, so the switch
+ * must advertise its routes again. */
+int route_recompute(struct RouteTable *table);
+
+/* Encodes routes into buf for the neighbor on port, starting with route
+ * *next and stopping before max bytes; routes through that neighbor are
+ * advertised as unreachable (poison reverse). Advances *next and returns the
+ * number of bytes written. */
+int route_encode(const struct RouteTable *table, int port, int *next,
+                 char *buf, int max);
+
+/* Returns one of the ports on a shortest path to dst, chosen by flowHash so
+ * that a flow always takes the same one, or -1 if there is no route. */
+int route_next_hop(const struct RouteTable *table, int dst,
+                   unsigned int flowHash);
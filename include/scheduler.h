@@ -0,0 +1,34 @@
+/*
+    scheduler.h
+    runs every node of the network as a task on a pool of worker threads
+*/
+
+#pragma once
+
+struct EventLoop;
+
+/* A node that can be driven without a process of its own. step() handles one
+ * wakeup of the node without blocking longer than timeoutMs and returns 1 if
+ * the node still has queued work, 0 once it is waiting on its event loop. */
+struct NodeTask {
+  int id;
+  void *context;
+  int (*step)(void *context, int timeoutMs);
+  struct EventLoop *loop;  // Readable whenever the node has events
+  int homeWorker;          // Worker whose epoll watches loop
+  int ready;               // Queued for the next virtual-time round
+  struct NodeTask *next;
+};
+
+/* Starts numThreads worker threads that share the given list of tasks and
+ * returns once they are running. Each worker keeps a deque of ready tasks and
+ * idle workers steal from busy ones. A task is only ever run by one worker at
+ * a time. Returns 0 on success, -1 on failure. */
+int scheduler_start(struct NodeTask *tasks, int numThreads);
+
+/* Starts one simulation thread that runs every task against the virtual
+ * clock of event_loop_use_virtual_time() and returns once it is running.
+ * Ready tasks are stepped in node id order; when none is ready the clock
+ * jumps straight to the next timer, so runs are fast and repeatable.
+ * Returns 0 on success, -1 on failure. */
+int scheduler_start_virtual(struct NodeTask *tasks);
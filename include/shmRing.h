@@ -0,0 +1,43 @@
+/*
+    shmRing.h
+    single-producer/single-consumer byte ring in shared memory, used by the
+    SHM links between nodes on the same machine
+*/
+
+#pragma once
+
+#include "constants.h"
+
+// Bytes a ring holds; a power of two that fits several output batches
+#define SHM_RING_BYTES 65536
+
+#if (SHM_RING_BYTES & (SHM_RING_BYTES - 1)) != 0
+#error "SHM_RING_BYTES must be a power of two"
+#endif
+
+struct ShmRing;
+
+/* Maps a ring into memory shared with every process forked afterwards, so it
+ * must be created before the nodes are forked. Returns NULL on failure. */
+struct ShmRing *shm_ring_create();
+
+/* Returns the ring's eventfd, which polls readable when the producer has
+ * added bytes after the consumer found the ring empty. */
+int shm_ring_fd(struct ShmRing *ring);
+
+/* Returns the eventfd that polls readable when the consumer has made room
+ * after the producer found the ring full. It is cleared by the producer's
+ * next shm_ring_write(). */
+int shm_ring_space_fd(struct ShmRing *ring);
+
+/* Copies as many of len bytes into the ring as it has room for. The consumer
+ * is only woken through its eventfd if it is waiting for data. Returns the
+ * number of bytes added; when it is less than len, the space eventfd reports
+ * when to try again. len may be 0 to just clear the space eventfd. */
+int shm_ring_write(struct ShmRing *ring, const char *buf, int len);
+
+/* Copies up to max of the bytes waiting in the ring into buf. When the ring is
+ * empty, the consumer is marked as waiting so that the next write signals the
+ * eventfd. A producer waiting for room is woken once bytes are taken.
+ * Returns the number of bytes copied, 0 if none. */
+int shm_ring_read(struct ShmRing *ring, char *buf, int max);
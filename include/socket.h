@@ -6,10 +6,87 @@ socket.h
 
 #include "constants.h"
 
+/*
+ * A SOCKET link keeps one long-lived TCP connection in each direction: a node
+ * connects to the remote node's listening socket to send, and accepts the
+ * remote node's connection on its own listening socket to receive. Packets
+ * travel as a framed byte stream over these connections.
+ */
+
+/* Creates the nonblocking listening socket of a link end. Returns the socket,
+ * or -1 on failure. */
 int sock_server_init(const char* localDomain, const int localPort);
 
-int sock_recv(const int sockfd, char* buffer, const int bufferMax,
-              const char* remoteDomain);
+/* Accepts a pending connection from remoteDomain on the listening socket
+ * sockfd; connections from other addresses are refused. Returns the
+ * nonblocking connected socket, or -1 if none is pending. */
+int sock_accept(const int sockfd, const char* remoteDomain);
+
+/* Reads what has arrived on the connected socket sockfd without waiting.
+ * Returns the number of bytes read, 0 if nothing has arrived, or -1 if the
+ * connection was closed or failed. */
+int sock_recv(const int sockfd, char* buffer, const int bufferMax);
+
+/* Starts a nonblocking connect from localDomain to remoteDomain:remotePort.
+ * Returns the socket, which may still be connecting, or -1 on failure. */
+int sock_connect(const char* localDomain, const char* remoteDomain,
+                 const int remotePort);
+
+/* Checks, without waiting, on a socket returned by sock_connect(). Returns 1
+ * once it is connected, 0 while connecting, or -1 if the connect failed. */
+int sock_connected(const int sockfd);
+
+/* Sends as much of msg as the connected socket sockfd takes without waiting.
+ * Returns the number of bytes sent, possibly fewer than msgLen, or -1 if the
+ * connection failed. */
+int sock_send(const int sockfd, const char* msg, const int msgLen);
+
+// Most datagrams moved by one sendmmsg() or recvmmsg() call
+#define SOCK_UDP_BATCH 32
+
+/* Creates the nonblocking UDP socket of a UDP link end, bound to
+ * localDomain:localPort and connected to remoteDomain:remotePort. Returns the
+ * socket, or -1 on failure. */
+int sock_udp_init(const char* localDomain, const int localPort,
+                  const char* remoteDomain, const int remotePort);
+
+/* Sends count datagrams whose contents lie back to back in buffer, lens[i]
+ * bytes each, with as few system calls as possible. Datagrams the socket
+ * cannot take are lost. Returns the number sent, or -1 on failure. */
+int sock_udp_send(const int sockfd, char* buffer, const int* lens,
+                  const int count);
+
+/* Receives up to max datagrams without waiting, datagram i into the slotSize
+ * byte slot at slots + i * slotSize, and stores its length in lens[i] (-1 if
+ * it did not fit). Returns the number received, 0 if none, or -1 on failure. */
+int sock_udp_recv(const int sockfd, char* slots, const int slotSize,
+                  int* lens, const int max);
+
+/*
+ * A LOCAL link connects nodes on one machine over AF_UNIX SOCK_SEQPACKET
+ * sockets named by filesystem paths, with one connection in each direction
+ * like a SOCKET link. Every output batch is sent as one record, so a record
+ * always holds whole packets.
+ */
+
+/* Creates the nonblocking listening socket bound to localPath, replacing a
+ * stale socket file. Returns the socket, or -1 on failure. */
+int sock_local_server_init(const char* localPath);
+
+/* Returns a pending connection on the listening socket sockfd as a
+ * nonblocking socket, or -1 if none is pending. */
+int sock_local_accept(const int sockfd);
+
+/* Connects to the socket listening at remotePath. Returns the nonblocking
+ * connected socket, or -1 if nothing listens there yet. */
+int sock_local_connect(const char* remotePath);
+
+/* Sends msg as one record without waiting. Returns 1 if it was sent, 0 if the
+ * socket had no room for it (nothing was sent, so the whole record can be
+ * retried), or -1 if the connection failed. */
+int sock_local_send(const int sockfd, const char* msg, const int msgLen);
 
-int sock_send(const char* localDomain, const char* remoteDomain,
-              const int remotePort, char* msg, int msgLen);
\ No newline at end of file
+/* Reads the next record into buffer without waiting. Returns its length, 0 if
+ * none has arrived (or it did not fit and was dropped), or -1 if the
+ * connection was closed or failed. */
+int sock_local_recv(const int sockfd, char* buffer, const int bufferMax);
@@ -4,18 +4,111 @@
 
 #pragma once
 
+#include <stdint.h>
+
 // Forward declarations
 struct Net_port;
 struct Job;
+struct Packet;
+struct NodeTask;
+
+// Most nodes a switch's forwarding table holds (a power of two); when it is
+// full, the least recently heard node makes room for a new one
+#ifndef FDB_CAPACITY
+#define FDB_CAPACITY 1024
+#endif
+
+// A node not heard from for this long is forgotten, so its packets are
+// broadcast again until it is learned anew (in milliseconds)
+#ifndef FDB_AGING_MS
+#define FDB_AGING_MS 300000
+#endif
+
+// With SWITCH_DEBUG_QUEUE, a switch checks for ports that dropped packets
+// and reports them this often (in milliseconds)
+#ifndef SWITCH_QUEUE_REPORT_MS
+#define SWITCH_QUEUE_REPORT_MS 1000
+#endif
+
+#if (FDB_CAPACITY & (FDB_CAPACITY - 1)) != 0
+#error "FDB_CAPACITY must be a power of two"
+#endif
 
-struct TableEntry {
+/* A node learned by a switch: the port it was last heard on and when. Entries
+ * are chained from most to least recently heard through prev and next, or
+ * through next alone while unused; -1 ends a chain. */
+struct FdbEntry {
   int id;
-  struct TableEntry *next;
+  int port;
+  long long lastSeenMs;
+  int prev;
+  int next;
+};
+
+/* Hash slot of a node id, pointing at its entry; -1 if the slot is free. */
+struct FdbSlot {
+  int id;
+  int entry;
+};
+
+/* Forwarding table of a switch. Ids are found by open addressing with linear
+ * probing over slots kept at most half full, so most lookups touch a single
+ * slot. Everything has a fixed size, so nothing is allocated while a switch
+ * runs. */
+struct ForwardingTable {
+  struct FdbSlot slots[2 * FDB_CAPACITY];
+  struct FdbEntry entries[FDB_CAPACITY];
+  int lruHead;  // Most recently heard node
+  int lruTail;  // Least recently heard node, the next to be evicted
+  int freeList;
+  int numEntries;
 };
 
+// Layout version of STP control payloads
+#define STP_VERSION 1
+
+/* Payload of a PKT_CONTROL packet, sent in network byte order. Later layouts
+ * append fields (e.g. port cost, bridge priority) and raise headerLen;
+ * receivers ignore bytes beyond the fields they know. */
+struct StpMsg {
+  uint8_t version;
+  uint8_t headerLen;      // Payload bytes taken by the sender's fields
+  uint8_t senderType;     // 'S' for a switch, 'X' for an endpoint
+  uint8_t isSenderChild;  // 'Y' if the receiver is the sender's parent
+  uint32_t rootId;
+  uint32_t rootDist;
+  uint32_t seq;  // Counts the sender's STP rounds
+};
+
+_Static_assert(sizeof(struct StpMsg) == 16, "StpMsg must not be padded");
+
 long long current_time_ms();
 
+/* Sends an endpoint's STP control packet for round seq on every port. */
 void controlPacketSender_endpoint(int nodeId, struct Net_port **node_port_array,
-                                  int node_port_array_size);
+                                  int node_port_array_size, unsigned int seq);
+
+/* Handles a control packet an endpoint received on port: a switch's first one
+ * is answered at once with the endpoint's control packet for round seq, so a
+ * switch started after its neighbors need not wait for their next keepalive.
+ * Returns 1 if an answer was sent. */
+int controlPacketReceived_endpoint(int nodeId, struct Net_port *port,
+                                   const struct Packet *pkt, unsigned int seq);
+
+/* Returns how often nodes send STP keepalives, or 0 if they only send their
+ * first control packet (in virtual-time mode). */
+int stp_hello_interval_ms();
+
+/* Has every switch also route packets for known endpoints along all shortest
+ * paths, spreading flows over the equal-cost ones. Must be called before the
+ * switches start. */
+void switch_use_ecmp();
 
 void switch_main(int switch_id);
+
+/* Runs one wakeup of a switch without blocking longer than timeoutMs. Returns
+ * 1 if the switch still has jobs queued. */
+int switch_step(void *context, int timeoutMs);
+
+/* Sets up a switch as a task for the threaded scheduler. */
+void switch_task_init(struct NodeTask *task, int switch_id);
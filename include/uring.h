@@ -0,0 +1,61 @@
+/*
+    uring.h
+    optional io_uring backend for a node's pipe links
+*/
+
+#pragma once
+
+#include "constants.h"
+
+// Forward declaration, defined in net.h
+struct Net_port;
+
+// Receive buffers lent to the kernel for multishot reads, per node
+#define URING_RX_BUFFERS 32
+#define URING_RX_BUFFER_SIZE 2048
+
+// Output batches that can be queued before a flush, per node
+#define URING_TX_SLOTS 32
+#define URING_TX_SLOT_SIZE PACKET_TX_BATCH_BYTES
+
+struct Uring;
+
+/* Makes every node attempt to drive its pipe links through io_uring. Nodes
+ * whose kernel refuses to set up a ring keep using read()/write(). */
+void uring_enable();
+
+/* Returns 1 once uring_enable() has been called, 0 otherwise. */
+int uring_enabled();
+
+/* Creates a node's ring. Returns NULL if the kernel does not support
+ * io_uring with provided buffer rings or the ring cannot be set up. */
+struct Uring *uring_create();
+
+/* Returns the ring's fd, which polls readable while completions are waiting. */
+int uring_fd(struct Uring *ring);
+
+/* Keeps a read armed on port's pipe; the bytes it receives are appended to
+ * the port's stream buffer and announced by uring_reap() as port number
+ * index. Returns 0
+ * on success, -1 if the port must be read directly instead. */
+int uring_watch_port(struct Uring *ring, struct Net_port *port, int index);
+
+/* Queues a write of the first len bytes of port's output queue, at buf, to
+ * its pipe. buf is copied, so the queue may be moved or added to meanwhile.
+ * The write is issued by the next uring_flush() and its result handed to
+ * packet_write_done() once it completes. Returns 0 if queued, -1 if the
+ * caller must write() the bytes itself. */
+int uring_queue_write(struct Uring *ring, struct Net_port *port,
+                      const char *buf, int len);
+
+/* Submits all queued writes and re-armed reads with one system call. */
+void uring_flush(struct Uring *ring);
+
+/* Consumes the ring's completions and stores in ports[] up to max numbers of
+ * ports that have newly buffered bytes. Returns how many were stored. */
+int uring_reap(struct Uring *ring, int *ports, int max);
+
+/* Returns 1 if ports announced by uring_reap() are still waiting to be
+ * reported, 0 otherwise. */
+int uring_has_ready(struct Uring *ring);
+
@@ -0,0 +1,322 @@
+/*
+    eventLoop.c
+*/
+
+#include "eventLoop.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "net.h"
+#include "shmRing.h"
+#include "uring.h"
+
+// The epoll user data carries the event kind in the high word and the index
+// in the low word
+#define EVENT_PACK(kind, index) (((uint64_t)(kind) << 32) | (uint32_t)(index))
+#define EVENT_KIND(data) ((enum EventKind)((data) >> 32))
+#define EVENT_INDEX(data) ((int)(uint32_t)(data))
+
+// Readiness of the loop's io_uring, translated into port events by
+// event_loop_wait()
+#define EVENT_RING_INDEX -1
+
+/*
+ * Virtual-time mode: armed timers are entries of a binary min-heap ordered by
+ * deadline, then by arming order so that simultaneous timers always fire in
+ * the same order. Re-arming a loop bumps its generation instead of searching
+ * the heap; entries of an older generation are dropped when they surface.
+ * Only the single simulation thread touches this state.
+ */
+struct VirtualTimer {
+  long long deadline;
+  unsigned long long seq;
+  unsigned int generation;
+  struct EventLoop *el;
+};
+
+static int g_virtual_time = 0;
+static long long g_virtual_now_ms = 0;
+static unsigned long long g_virtual_seq = 0;
+static struct VirtualTimer *g_timer_heap = NULL;
+static int g_timer_heap_size = 0;
+static int g_timer_heap_capacity = 0;
+
+static int virtual_timer_before(const struct VirtualTimer *a,
+                                const struct VirtualTimer *b) {
+  if (a->deadline != b->deadline) {
+    return a->deadline < b->deadline;
+  }
+  return a->seq < b->seq;
+}  // End of virtual_timer_before()
+
+static void virtual_timer_push(struct EventLoop *el, long long deadline) {
+  if (g_timer_heap_size == g_timer_heap_capacity) {
+    g_timer_heap_capacity =
+        (g_timer_heap_capacity == 0) ? 64 : 2 * g_timer_heap_capacity;
+    g_timer_heap = (struct VirtualTimer *)realloc(
+        g_timer_heap, g_timer_heap_capacity * sizeof(struct VirtualTimer));
+  }
+
+  struct VirtualTimer t = {deadline, g_virtual_seq++, el->timerGeneration, el};
+  int i = g_timer_heap_size++;
+  while (i > 0 && virtual_timer_before(&t, &g_timer_heap[(i - 1) / 2])) {
+    g_timer_heap[i] = g_timer_heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  g_timer_heap[i] = t;
+}  // End of virtual_timer_push()
+
+static void virtual_timer_pop() {
+  struct VirtualTimer last = g_timer_heap[--g_timer_heap_size];
+  int i = 0;
+  while (1) {
+    int child = 2 * i + 1;
+    if (child >= g_timer_heap_size) {
+      break;
+    }
+    if (child + 1 < g_timer_heap_size &&
+        virtual_timer_before(&g_timer_heap[child + 1], &g_timer_heap[child])) {
+      child++;
+    }
+    if (!virtual_timer_before(&g_timer_heap[child], &last)) {
+      break;
+    }
+    g_timer_heap[i] = g_timer_heap[child];
+    i = child;
+  }
+  g_timer_heap[i] = last;
+}  // End of virtual_timer_pop()
+
+int event_loop_init(struct EventLoop *el) {
+  el->timerDeadline = 0;
+  el->timerIntervalMs = 0;
+  el->timerGeneration = 0;
+  el->timerDue = 0;
+  el->owner = NULL;
+  el->ring = NULL;
+
+  el->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (el->epfd < 0) {
+    fprintf(stderr, "\nError: event_loop_init: epoll_create1 failed\n");
+    perror("\t");
+    return -1;
+  }
+
+  el->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (el->timerfd < 0) {
+    fprintf(stderr, "\nError: event_loop_init: timerfd_create failed\n");
+    perror("\t");
+    close(el->epfd);
+    return -1;
+  }
+
+  if (event_loop_add_fd(el, el->timerfd, EVENT_TIMER, 0) < 0) {
+    return -1;
+  }
+
+  if (uring_enabled()) {
+    // Without a ring the node simply keeps polling its pipes
+    el->ring = uring_create();
+    if (el->ring != NULL &&
+        event_loop_add_fd(el, uring_fd(el->ring), EVENT_PORT,
+                          EVENT_RING_INDEX) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}  // End of event_loop_init()
+
+int event_loop_add_fd(struct EventLoop *el, int fd, enum EventKind kind,
+                      int index) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u64 = EVENT_PACK(kind, index);
+  if (epoll_ctl(el->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    fprintf(stderr, "\nError: event_loop_add_fd: failed to watch fd %d\n", fd);
+    perror("\t");
+    return -1;
+  }
+  return 0;
+}  // End of event_loop_add_fd()
+
+void event_loop_remove_fd(struct EventLoop *el, int fd) {
+  epoll_ctl(el->epfd, EPOLL_CTL_DEL, fd, NULL);
+}  // End of event_loop_remove_fd()
+
+int event_loop_add_port(struct EventLoop *el, struct Net_port *port,
+                        int index) {
+  // Connections accepted on a socket port are reported under the same index,
+  // and so is room in the send buffer of a port the ring found full
+  port->loop = el;
+  port->loopIndex = index;
+  if (el->ring != NULL && uring_watch_port(el->ring, port, index) == 0) {
+    return 0;
+  }
+  // Room made in a full outgoing ring is reported under the port too
+  if (port->type == SHM &&
+      event_loop_add_fd(el, shm_ring_space_fd(port->shmTx), EVENT_PORT,
+                        index) < 0) {
+    return -1;
+  }
+  return event_loop_add_fd(el, net_port_recv_fd(port), EVENT_PORT, index);
+}  // End of event_loop_add_port()
+
+int event_loop_watch_write(struct EventLoop *el, int fd, int index,
+                           int enable) {
+  if (!enable) {
+    epoll_ctl(el->epfd, EPOLL_CTL_DEL, fd, NULL);
+    return 0;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLOUT;
+  ev.data.u64 = EVENT_PACK(EVENT_PORT, index);
+  if (epoll_ctl(el->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    fprintf(stderr,
+            "\nError: event_loop_watch_write: failed to watch fd %d\n", fd);
+    perror("\t");
+    return -1;
+  }
+  return 0;
+}  // End of event_loop_watch_write()
+
+void event_loop_flush(struct EventLoop *el) {
+  if (el->ring != NULL) {
+    uring_flush(el->ring);
+  }
+}  // End of event_loop_flush()
+
+int event_loop_pending(struct EventLoop *el) {
+  return el->ring != NULL && uring_has_ready(el->ring);
+}  // End of event_loop_pending()
+
+void event_loop_arm_timer(struct EventLoop *el, int initialMs, int intervalMs) {
+  if (g_virtual_time) {
+    el->timerGeneration++;
+    el->timerDue = 0;
+    el->timerIntervalMs = intervalMs;
+    if (initialMs > 0 || intervalMs > 0) {
+      el->timerDeadline = g_virtual_now_ms + initialMs;
+      virtual_timer_push(el, el->timerDeadline);
+    }
+    return;
+  }
+
+  struct itimerspec spec;
+  spec.it_value.tv_sec = initialMs / 1000;
+  spec.it_value.tv_nsec = (long)(initialMs % 1000) * 1000000;
+  spec.it_interval.tv_sec = intervalMs / 1000;
+  spec.it_interval.tv_nsec = (long)(intervalMs % 1000) * 1000000;
+  timerfd_settime(el->timerfd, 0, &spec, NULL);
+}  // End of event_loop_arm_timer()
+
+void event_loop_disarm_timer(struct EventLoop *el) {
+  event_loop_arm_timer(el, 0, 0);
+}  // End of event_loop_disarm_timer()
+
+int event_loop_wait(struct EventLoop *el, struct Event *events, int maxEvents,
+                    int timeoutMs) {
+  struct epoll_event ready[EVENT_LOOP_MAX_EVENTS];
+  if (maxEvents > EVENT_LOOP_MAX_EVENTS) {
+    maxEvents = EVENT_LOOP_MAX_EVENTS;
+  }
+
+  if (g_virtual_time) {
+    // The simulation thread never blocks inside a node; a due timer is
+    // reported alongside whatever the node's fds have ready
+    timeoutMs = 0;
+    if (el->timerDue) {
+      maxEvents--;
+    }
+  }
+  if (event_loop_pending(el)) {
+    timeoutMs = 0;
+  }
+  event_loop_flush(el);
+
+  int n = epoll_wait(el->epfd, ready, maxEvents, timeoutMs);
+  if (n < 0) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    fprintf(stderr, "\nError: event_loop_wait: epoll_wait failed\n");
+    perror("\t");
+    return -1;
+  }
+
+  int numEvents = 0;
+  for (int i = 0; i < n; i++) {
+    struct Event *ev = &events[numEvents];
+    ev->kind = EVENT_KIND(ready[i].data.u64);
+    ev->index = EVENT_INDEX(ready[i].data.u64);
+    if (ev->kind == EVENT_PORT && ev->index == EVENT_RING_INDEX) {
+      // Completions are collected below
+      continue;
+    }
+    if (ev->kind == EVENT_TIMER) {
+      // Acknowledge every expiration so the timerfd stops reporting ready
+      uint64_t expirations;
+      read(el->timerfd, &expirations, sizeof(expirations));
+    }
+    numEvents++;
+  }
+  n = numEvents;
+
+  if (el->ring != NULL) {
+    // One port event for every port the ring has received bytes on
+    int ports[EVENT_LOOP_MAX_EVENTS];
+    int numPorts = uring_reap(el->ring, ports, maxEvents - n);
+    for (int i = 0; i < numPorts; i++) {
+      events[n].kind = EVENT_PORT;
+      events[n].index = ports[i];
+      n++;
+    }
+  }
+
+  if (g_virtual_time && el->timerDue) {
+    el->timerDue = 0;
+    events[n].kind = EVENT_TIMER;
+    events[n].index = 0;
+    n++;
+  }
+  return n;
+}  // End of event_loop_wait()
+
+void event_loop_use_virtual_time() { g_virtual_time = 1; }
+
+int event_loop_virtual_time() { return g_virtual_time; }
+
+long long event_loop_virtual_now_ms() { return g_virtual_now_ms; }
+
+int event_loop_advance_virtual_time(struct EventLoop **due, int maxDue) {
+  int numDue = 0;
+  while (g_timer_heap_size > 0 && numDue < maxDue) {
+    struct VirtualTimer t = g_timer_heap[0];
+    struct EventLoop *el = t.el;
+    if (t.generation != el->timerGeneration) {
+      // The loop was re-armed or disarmed since this entry was pushed
+      virtual_timer_pop();
+      continue;
+    }
+    if (numDue > 0 && t.deadline != g_virtual_now_ms) {
+      // Only report timers of one instant per call
+      break;
+    }
+
+    virtual_timer_pop();
+    g_virtual_now_ms = t.deadline;
+    el->timerDue = 1;
+    due[numDue++] = el;
+    if (el->timerIntervalMs > 0) {
+      el->timerDeadline = t.deadline + el->timerIntervalMs;
+      virtual_timer_push(el, el->timerDeadline);
+    }
+  }
+  return numDue;
+}  // End of event_loop_advance_virtual_time()
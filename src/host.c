@@ -12,11 +12,13 @@
 #include "color.h"
 #include "constants.h"
 #include "debug.h"
+#include "eventLoop.h"
 #include "job.h"
 #include "manager.h"
 #include "nameServer.h"
 #include "net.h"
 #include "packet.h"
+#include "scheduler.h"
 #include "switch.h"
 
 struct HostContext {
@@ -28,8 +30,16 @@ struct HostContext {
   struct Net_port *node_port_list;
   struct Net_port **node_port_array;
   int node_port_array_size;
-  char **nametable;
+  struct NameTable nametable;
+  int dnsId;  // Node id of the DNS server
   int isRequestingDownload;
+  struct TimerWheel timers;
+  struct EventLoop loop;
+  int timerIntervalMs;  // Period the host timer is armed with, 0 if disarmed
+  unsigned int numCtrlMsgsSent;
+  long long timeLastCtrlMsg;
+  struct PacketPool pktPool;
+  int linkMtu;  // Smallest MTU in the network, bounds outgoing payloads
 };
 
 // Forward Declarations of host.c specific functions:
@@ -37,6 +47,7 @@ void commandDownloadHandler(struct HostContext *host, int dst,
                             char fname[MAX_FILENAME_LENGTH]);
 void commandHandler(struct HostContext *host);
 void commandUploadHandler(struct HostContext *host, int dst, char *fname);
+struct Job *findJob(struct HostContext *host, char *id);
 struct HostContext *initHostContext(int host_id);
 void jobSendDownloadResponseHandler(struct HostContext *host,
                                     struct Job *job_from_queue);
@@ -49,9 +60,11 @@ void jobSendUploadResponseHandler(struct HostContext *host,
 void jobUploadSendHandler(struct HostContext *host, struct Job *job_from_queue);
 void jobWaitForResponseHandler(struct HostContext *host, struct Job *job);
 int parseManMsg(char *msg, char *cmd, char *dstStr, char *fname);
-void parsePacket(const char *inputStr, char *ticketStr, char *dataStr);
+void parsePacket(const char *inputStr, char *ticketStr, char *dataStr,
+                 int dataSize);
 void pktIncomingRequest(struct HostContext *host, struct Packet *inPkt);
 void pktIncomingResponse(struct HostContext *host, struct Packet *inPkt);
+void pktReceiveFromPort(struct HostContext *host, int portNum);
 void pktUploadEnd(struct HostContext *host, struct Packet *pkt);
 void pktUploadReceive(struct HostContext *host, struct Packet *pkt);
 void sendMsgToManager(int fd, char msg[MAX_MSG_LENGTH]);
@@ -61,6 +74,8 @@ int resolveHostname(struct HostContext *host, char *name);
 int requestIDFromDNS(struct HostContext *host, char *nameToResolve);
 int updateNametable(struct HostContext *host, int hostId,
                     char name[MAX_NAME_LEN]);
+void timerTickHandler(struct HostContext *host);
+void wakeJob(struct HostContext *host, struct Job *job);
 
 ////////////////////////////////////////////////
 ////////////////// HOST MAIN ///////////////////
@@ -68,164 +83,138 @@ void host_main(int host_id) {
   ////// Initialize state of host //////
   struct HostContext *host = initHostContext(host_id);
 
-  unsigned int numCtrlMsgsSent = 0;
-  static long long timeLast = 0;
-
+  int timeout = 0;
   while (1) {
-    // Periodically broadcast STP Control Packets
-    long long timeNow = current_time_ms();
-    if (timeNow - timeLast > PERIODIC_CTRL_MSG_WAITTIME_MS &&
-        numCtrlMsgsSent < ALLOWED_CONVERGENCE_ROUNDS) {
-      numCtrlMsgsSent++;
-      controlPacketSender_endpoint(host->_id, host->node_port_array,
-                                   host->node_port_array_size);
-      timeLast = timeNow;
-    }
-    ////////////////////////////////////////////////////////////////
-    ////////////////////////////////
-    //////////////// COMMAND HANDLER
-
-    // Attempt to retrieve issued command from manager
-    int n = get_man_msg(host->man_port, host->man_msg);
-    if (n > 0) {
-      // Received a man_msg...
-      commandHandler(host);
-    }
+    // Block in the event loop once nothing is left to run
+    timeout = host_step(host, timeout) ? 0 : -1;
+  }
+}  // End of host_main()
 
-    //////////////// COMMAND HANDLER
-    ////////////////////////////////
-    ////////////////////////////////////////////////////////////////
+/*
+Runs one wakeup of the host: waits up to timeoutMs for the manager, a port or
+the timer, handles whatever is ready and runs the queued jobs. Returns 1 if
+runnable jobs are still queued.
+*/
+int host_step(void *context, int timeoutMs) {
+  struct HostContext *host = (struct HostContext *)context;
+  struct Event events[EVENT_LOOP_MAX_EVENTS];
+
+  // Sleep until the manager, a port or the host timer needs attention
+  int numEvents =
+      event_loop_wait(&host->loop, events, EVENT_LOOP_MAX_EVENTS, timeoutMs);
+
+  for (int e = 0; e < numEvents; e++) {
+    switch (events[e].kind) {
+      //////////////// TIMER HANDLER
+      case EVENT_TIMER:
+        timerTickHandler(host);
+        break;
 
-    // -------------------------------------------------------------
+      //////////////// COMMAND HANDLER
+      case EVENT_MANAGER:
+        // Attempt to retrieve issued command from manager
+        if (get_man_msg(host->man_port, host->man_msg) > 0) {
+          // Received a man_msg...
+          commandHandler(host);
+        }
+        break;
 
-    ////////////////////////////////////////////////////////////////
-    ////////////////////////////////
-    //////////////// PACKET HANDLER
+      //////////////// PACKET HANDLER
+      case EVENT_PORT:
+        pktReceiveFromPort(host, events[e].index);
+        break;
+    }
+  }
 
-    for (int portNum = 0; portNum < host->node_port_array_size; portNum++) {
-      // Receive packets for all ports in node_port_array
-      struct Packet *inPkt = createEmptyPacket();
-      n = packet_recv(host->node_port_array[portNum], inPkt);
-      // if portNum has received a packet, translate the packet into a job
-      if ((n > 0) && ((int)inPkt->dst == host->_id)) {
-        if (inPkt->type != PKT_CONTROL) {
-#ifdef HOST_DEBUG_PACKET_RECEIPT
-          colorPrint(MAGENTA, "Host%d received packet: ", host->_id);
-          printPacket(inPkt);
-#endif
-        }
+  // -------------------------------------------------------------
+  ////////////////////////////////////////////////////////////////
+  ////////////////////////////////
+  //////////////// JOB HANDLER
+
+  // Run the jobs that were queued before this pass, up to the budget.
+  // Jobs queued while running are picked up on the next pass, after the
+  // ports and manager pipe have been serviced again.
+  int jobsToRun = job_queue_length(*host->jobq);
+  if (jobsToRun > HOST_JOB_BUDGET) {
+    jobsToRun = HOST_JOB_BUDGET;
+  }
 
-        switch (inPkt->type) {
-          case PKT_CONTROL:
-            break;
-
-          case PKT_PING_REQ:
-          case PKT_UPLOAD_REQ:
-            pktIncomingRequest(host, inPkt);
-            break;
-
-          case PKT_DOWNLOAD_REQ: {
-            char *id = (char *)malloc(sizeof(char) * JIDLEN);
-            char *fname = (char *)malloc(sizeof(char) * MAX_RESPONSE_LEN);
-            parsePacket(inPkt->payload, id, fname);
-            commandUploadHandler(host, inPkt->src, fname);
-            free(id);
-            free(fname);
-            break;
-          }
+  for (int i = 0; i < jobsToRun; i++) {
+    /* Get a new job from the job queue */
+    struct Job *job_from_queue = job_dequeue(host->_id, *host->jobq);
 
-          case PKT_PING_RESPONSE:
-          case PKT_UPLOAD_RESPONSE:
-          case PKT_DOWNLOAD_RESPONSE:
-          case PKT_DNS_REGISTRATION_RESPONSE:
-          case PKT_DNS_QUERY_RESPONSE:
-            pktIncomingResponse(host, inPkt);
-            break;
-
-          case PKT_UPLOAD:
-            pktUploadReceive(host, inPkt);
-            break;
-
-          case PKT_UPLOAD_END:
-            pktUploadEnd(host, inPkt);
-            break;
-
-          default:
-            fprintf(stderr, "Host%d received a packet of unknown type\n",
-                    host->_id);
-            free(inPkt);
-            break;
-        }  // end of switch
-      } else {
-        // No packet addressed to host received
-        packet_delete(inPkt);
-      }
+    //////////////////// EXECUTE FETCHED JOB ////////////////////
+    switch (job_from_queue->type) {
+      ////////////////
+      case JOB_SEND_REQUEST: {
+        jobSendRequestHandler(host, job_from_queue);
+        break;
+      }  //////////////// End of JOB_SEND_REQUEST
 
-      //////////////// PACKET HANDLER
-      ////////////////////////////////
-      ////////////////////////////////////////////////////////////////
-      // -------------------------------------------------------------
-      ////////////////////////////////////////////////////////////////
-      ////////////////////////////////
-      //////////////// JOB HANDLER
-
-      if (job_queue_length(*host->jobq) > 0) {
-        /* Get a new job from the job queue */
-        struct Job *job_from_queue = job_dequeue(host->_id, *host->jobq);
-
-        //////////////////// EXECUTE FETCHED JOB ////////////////////
-        switch (job_from_queue->type) {
-          ////////////////
-          case JOB_SEND_REQUEST: {
-            jobSendRequestHandler(host, job_from_queue);
-            break;
-          }  //////////////// End of JOB_SEND_REQUEST
-
-          case JOB_SEND_RESPONSE: {
-            jobSendResponseHandler(host, job_from_queue);
-            break;
-          }  //////////////// End of case JOB_SEND_RESPONSE
-
-          case JOB_SEND_PKT: {
-            sendPacketTo(host->node_port_array, host->node_port_array_size,
-                         job_from_queue->packet);
-            job_delete(host->_id, job_from_queue);
-            break;
-          }  //////////////// End of case JOB_SEND_PKT
+      case JOB_SEND_RESPONSE: {
+        jobSendResponseHandler(host, job_from_queue);
+        break;
+      }  //////////////// End of case JOB_SEND_RESPONSE
 
-          case JOB_WAIT_FOR_RESPONSE: {
-            jobWaitForResponseHandler(host, job_from_queue);
-            break;
-          }  //////////////// End of case JOB_WAIT_FOR_RESPONSE
+      case JOB_SEND_PKT: {
+        sendPacketTo(host->node_port_array, host->node_port_array_size,
+                     job_from_queue->packet);
+        job_delete(host->_id, job_from_queue);
+        break;
+      }  //////////////// End of case JOB_SEND_PKT
 
-          case JOB_UPLOAD: {
-            jobUploadSendHandler(host, job_from_queue);
-            break;
-          }  //////////////// End of case JOB_UPLOAD
+      case JOB_WAIT_FOR_RESPONSE: {
+        jobWaitForResponseHandler(host, job_from_queue);
+        break;
+      }  //////////////// End of case JOB_WAIT_FOR_RESPONSE
 
-          case JOB_DOWNLOAD: {
-            break;
-          }  //////////////// End of case JOB_DOWNLOAD
+      case JOB_UPLOAD: {
+        jobUploadSendHandler(host, job_from_queue);
+        break;
+      }  //////////////// End of case JOB_UPLOAD
 
-          default:
+      case JOB_DOWNLOAD: {
+        break;
+      }  //////////////// End of case JOB_DOWNLOAD
+
+      default:
 #ifdef HOST_DEBUG
-            colorPrint(YELLOW,
-                       "Host%d's job_handler encountered a job with %s\n",
-                       host->_id, get_job_type_literal(job_from_queue->type));
+        colorPrint(YELLOW, "Host%d's job_handler encountered a job with %s\n",
+                   host->_id, get_job_type_literal(job_from_queue->type));
 #endif
-        }  // End of switch (job_from_queue->type)
-      }    // End of if (job_queue_length(&host->jobq) > 0)
+    }  // End of switch (job_from_queue->type)
+  }    // End of for (int i = 0; i < jobsToRun; i++)
+
+  // The timer ticks quickly only while jobs wait to expire (or the first STP
+  // packet is still to go out), and otherwise just for the STP keepalives
+  int tickMs = (host->numCtrlMsgsSent == 0 ||
+                timer_wheel_length(&host->timers) > 0)
+                   ? HOST_TICK_MS
+                   : stp_hello_interval_ms();
+  if (tickMs != host->timerIntervalMs) {
+    event_loop_arm_timer(&host->loop, tickMs, tickMs);
+    host->timerIntervalMs = tickMs;
+  }
 
-      /////////////////// JOB HANDLER
-      ///////////////////////////////////
-      ///////////////////////////////////////////////////////////////////////
+  /////////////////// JOB HANDLER
+  ///////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////
 
-      /* The host goes to sleep for 10 ms */
-      usleep(LOOP_SLEEP_TIME_US);
-    }  // End of for (int portNum = 0; portNum ...
+  packet_flush(host->node_port_array, host->node_port_array_size);
+  event_loop_flush(&host->loop);
 
-  }  // End of while(1)
-}  // End of host_main()
+  // Jobs waiting on a response are parked in the timer wheel, so anything
+  // left in the queue is runnable
+  return job_queue_length(*host->jobq) > 0 || event_loop_pending(&host->loop);
+}  // End of host_step()
+
+void host_task_init(struct NodeTask *task, int host_id) {
+  struct HostContext *host = initHostContext(host_id);
+  task->id = host_id;
+  task->context = host;
+  task->step = host_step;
+  task->loop = &host->loop;
+}  // End of host_task_init()
 
 //////////////////////////////////////////////////
 //////////////////////////////////////////////////
@@ -351,8 +340,8 @@ void commandHandler(struct HostContext *host) {
           createPacket(host->_id, dst, PKT_PING_REQ, 0, NULL);
 
       // Create send request job
-      struct Job *sendReqJob = job_create(NULL, TIMETOLIVE, JOB_SEND_REQUEST,
-                                          JOB_PENDING_STATE, preqPkt);
+      struct Job *sendReqJob =
+          job_create(NULL, JOB_SEND_REQUEST, JOB_PENDING_STATE, preqPkt);
       // Enqueue job
       job_enqueue(host->_id, *host->jobq, sendReqJob);
       break;
@@ -376,18 +365,18 @@ void commandHandler(struct HostContext *host) {
       char dnsName[MAX_NAME_LEN];
       strncpy(dnsName, dstStr, MAX_NAME_LEN);
 
-      int dnsNameLen = strnlen(dnsName, MAX_FILENAME_LENGTH);
+      int dnsNameLen = strnlen(dnsName, MAX_NAME_LEN - 1);
       dnsName[dnsNameLen] = '\0';
 
       // register own domain name in local cache
-      memcpy(host->nametable[host->_id], dnsName, PACKET_PAYLOAD_MAX);
+      nametable_set(&host->nametable, host->_id, dnsName);
 
       // Create a registration packet to send to DNS Server
       struct Packet *registerPkt = createPacket(
-          host->_id, STATIC_DNS_ID, PKT_DNS_REGISTRATION, dnsNameLen, dnsName);
+          host->_id, host->dnsId, PKT_DNS_REGISTRATION, dnsNameLen, dnsName);
       // Create send DNS Register request job
-      struct Job *sendRegReqJob = job_create(NULL, TIMETOLIVE, JOB_SEND_REQUEST,
-                                             JOB_PENDING_STATE, registerPkt);
+      struct Job *sendRegReqJob =
+          job_create(NULL, JOB_SEND_REQUEST, JOB_PENDING_STATE, registerPkt);
       // Enqueue job
       job_enqueue(host->_id, *host->jobq, sendRegReqJob);
       break;
@@ -428,8 +417,8 @@ void commandUploadHandler(struct HostContext *host, int dst, char *fname) {
       struct Packet *upReqPkt =
           createPacket(host->_id, dst, PKT_UPLOAD_REQ, 0, fname);
       // Create a send request job
-      struct Job *sendReqJob = job_create(NULL, TIMETOLIVE, JOB_SEND_REQUEST,
-                                          JOB_PENDING_STATE, upReqPkt);
+      struct Job *sendReqJob =
+          job_create(NULL, JOB_SEND_REQUEST, JOB_PENDING_STATE, upReqPkt);
       sendReqJob->fp = fp;
       strncpy(sendReqJob->filepath, fullPath, sizeof(sendReqJob->filepath));
       // Enque job
@@ -441,6 +430,18 @@ void commandUploadHandler(struct HostContext *host, int dst, char *fname) {
   free(responseMsg);
 }  // End of commandUploadHandler()
 
+/*
+Looks up a job by id, first among the jobs parked in the timer wheel waiting on
+a response and then among the runnable jobs in the job queue.
+*/
+struct Job *findJob(struct HostContext *host, char *id) {
+  struct Job *job = timer_wheel_find_id(&host->timers, id);
+  if (job == NULL) {
+    job = job_queue_find_id(*host->jobq, id);
+  }
+  return job;
+}  // End of findJob()
+
 struct HostContext *initHostContext(int host_id) {
   struct HostContext *host_context =
       (struct HostContext *)malloc(sizeof(struct HostContext));
@@ -471,6 +472,9 @@ struct HostContext *initHostContext(int host_id) {
     }
   }
 
+  // File chunks are sized to fit every link they may cross on the way
+  host_context->linkMtu = net_get_min_mtu();
+
   // Allocate memory for the JobQueue struct
   host_context->jobq = (struct JobQueue **)malloc(sizeof(struct JobQueue *));
   *host_context->jobq = (struct JobQueue *)malloc(sizeof(struct JobQueue));
@@ -478,11 +482,34 @@ struct HostContext *initHostContext(int host_id) {
   // Initialize the JobQueue struct
   job_queue_init(*host_context->jobq);
 
-  host_context->nametable = malloc((MAX_NUM_NAMES + 1) * sizeof(char *));
-  init_nametable(host_context->nametable);
+  // Jobs waiting on a response are parked here until answered or expired
+  timer_wheel_init(&host_context->timers, current_time_ms(), HOST_TICK_MS);
+
+  init_nametable(&host_context->nametable);
+  host_context->dnsId = net_get_dns_id();
 
   host_context->isRequestingDownload = 0;
 
+  host_context->numCtrlMsgsSent = 0;
+  host_context->timeLastCtrlMsg = 0;
+
+  // Wake on manager commands, incoming packets and the host timer
+  if (event_loop_init(&host_context->loop) < 0) {
+    exit(EXIT_FAILURE);
+  }
+  event_loop_add_fd(&host_context->loop, host_context->man_port->recv_fd,
+                    EVENT_MANAGER, 0);
+  for (int portNum = 0; portNum < host_context->node_port_array_size;
+       portNum++) {
+    event_loop_add_port(&host_context->loop,
+                        host_context->node_port_array[portNum], portNum);
+  }
+  event_loop_arm_timer(&host_context->loop, 1, HOST_TICK_MS);
+  host_context->timerIntervalMs = HOST_TICK_MS;
+
+  // Received packets come from the host's own pool
+  packet_pool_init(&host_context->pktPool);
+
   return host_context;
 }  // End of initHostContext()
 
@@ -490,9 +517,9 @@ void jobSendDownloadResponseHandler(struct HostContext *host,
                                     struct Job *job_from_queue) {
   struct Packet *qPkt = job_from_queue->packet;
 
-  char *id = (char *)malloc(sizeof(char) * JIDLEN);
+  char *id = (char *)malloc(sizeof(char) * (JIDLEN + 1));
   char *fname = (char *)malloc(sizeof(char) * MAX_RESPONSE_LEN);
-  parsePacket(qPkt->payload, id, fname);
+  parsePacket(qPkt->payload, id, fname, MAX_RESPONSE_LEN);
 
   char fullPath[2 * MAX_FILENAME_LENGTH] = {0};
 
@@ -521,9 +548,9 @@ void jobSendDownloadResponseHandler(struct HostContext *host,
       readyFlag = 1;
     }
   }
-  int payloadMsgLen = strnlen(payloadMsg, PACKET_PAYLOAD_MAX);
-  memset(qPkt->payload, 0, PACKET_PAYLOAD_MAX);
+  int payloadMsgLen = strnlen(payloadMsg, host->linkMtu);
   memcpy(qPkt->payload, payloadMsg, payloadMsgLen);
+  qPkt->payload[payloadMsgLen] = '\0';
   qPkt->length = payloadMsgLen;
 
   sendPacketTo(host->node_port_array, host->node_port_array_size, qPkt);
@@ -571,18 +598,19 @@ void jobSendRequestHandler(struct HostContext *host,
   sendPacketTo(host->node_port_array, host->node_port_array_size,
                job_from_queue->packet);
 
+  // Park the request until its response arrives or it times out
   job_from_queue->type = JOB_WAIT_FOR_RESPONSE;
-  job_enqueue(host->_id, *host->jobq, job_from_queue);
-
+  timer_wheel_add(&host->timers, job_from_queue,
+                  current_time_ms() + RESPONSE_TIMEOUT_MS);
 }  // End of jobSendRequestHandler
 
 void jobSendUploadResponseHandler(struct HostContext *host,
                                   struct Job *job_from_queue) {
   struct Packet *qPkt = job_from_queue->packet;
 
-  char *id = (char *)malloc(sizeof(char) * JIDLEN);
+  char *id = (char *)malloc(sizeof(char) * (JIDLEN + 1));
   char *fname = (char *)malloc(sizeof(char) * MAX_RESPONSE_LEN);
-  parsePacket(qPkt->payload, id, fname);
+  parsePacket(qPkt->payload, id, fname, MAX_RESPONSE_LEN);
 
   char fullPath[2 * MAX_FILENAME_LENGTH] = {0};
 
@@ -607,12 +635,13 @@ void jobSendUploadResponseHandler(struct HostContext *host,
       strncpy(job_from_queue->filepath, fullPath,
               strnlen(fullPath, MAX_FILENAME_LENGTH * 2));
       job_from_queue->type = JOB_WAIT_FOR_RESPONSE;
-      job_enqueue(host->_id, *host->jobq, job_from_queue);
+      timer_wheel_add(&host->timers, job_from_queue,
+                      current_time_ms() + RESPONSE_TIMEOUT_MS);
     }
   }
-  int payloadMsgLen = strnlen(payloadMsg, PACKET_PAYLOAD_MAX);
-  memset(qPkt->payload, 0, PACKET_PAYLOAD_MAX);
+  int payloadMsgLen = strnlen(payloadMsg, host->linkMtu);
   memcpy(qPkt->payload, payloadMsg, payloadMsgLen);
+  qPkt->payload[payloadMsgLen] = '\0';
   qPkt->length = payloadMsgLen;
 
   sendPacketTo(host->node_port_array, host->node_port_array_size, qPkt);
@@ -625,9 +654,9 @@ void jobSendUploadResponseHandler(struct HostContext *host,
 
 void jobUploadSendHandler(struct HostContext *host,
                           struct Job *job_from_queue) {
-  char *id = (char *)malloc(sizeof(char) * JIDLEN);
+  char *id = (char *)malloc(sizeof(char) * (JIDLEN + 1));
   char *msg = (char *)malloc(sizeof(char) * MAX_RESPONSE_LEN);
-  parsePacket(job_from_queue->packet->payload, id, msg);
+  parsePacket(job_from_queue->packet->payload, id, msg, MAX_RESPONSE_LEN);
   int dst = job_from_queue->packet->dst;
   int src = host->_id;
 
@@ -640,9 +669,13 @@ void jobUploadSendHandler(struct HostContext *host,
   // Set the file position to the current offset
   fseek(fp, job_from_queue->fileOffset, SEEK_SET);
 
-  // Allocate a buffer for reading data from the file
+  // Allocate a buffer for reading data from the file; a chunk must still fit
+  // the host's links once the job id is prepended to it
   int bufferSize = MAX_RESPONSE_LEN - 1;
-  char *buffer = (char *)malloc(sizeof(char) * bufferSize);
+  if (bufferSize > host->linkMtu - JIDLEN - 2) {
+    bufferSize = host->linkMtu - JIDLEN - 2;
+  }
+  char *buffer = (char *)malloc(sizeof(char) * (bufferSize + 1));
 
   // Read and send one chunk of the file
   int chunkSize;
@@ -653,13 +686,13 @@ void jobUploadSendHandler(struct HostContext *host,
   }
 
   // Clear the buffer before reading new data
-  memset(buffer, 0, bufferSize * sizeof(char));
+  memset(buffer, 0, (bufferSize + 1) * sizeof(char));
 
   int bytesRead = fread(buffer, sizeof(char), chunkSize, fp);
 
   if (bytesRead >= 0) {
     struct Packet *p = createPacket(src, dst, PKT_UPLOAD, 0, buffer);
-    struct Job *j = job_create(id, 0, JOB_SEND_PKT, JOB_COMPLETE_STATE, p);
+    struct Job *j = job_create(id, JOB_SEND_PKT, JOB_COMPLETE_STATE, p);
     job_enqueue(host->_id, *host->jobq, j);
 
     // Update the file offset
@@ -670,7 +703,7 @@ void jobUploadSendHandler(struct HostContext *host,
       // Notify the receiver that the file transfer is complete
       struct Packet *finPkt = createPacket(src, dst, PKT_UPLOAD_END, 0, NULL);
       struct Job *finJob =
-          job_create(id, TIMETOLIVE, JOB_SEND_PKT, JOB_COMPLETE_STATE, finPkt);
+          job_create(id, JOB_SEND_PKT, JOB_COMPLETE_STATE, finPkt);
       job_enqueue(host->_id, *host->jobq, finJob);
       job_from_queue->state = JOB_COMPLETE_STATE;
     }
@@ -687,7 +720,8 @@ void jobWaitForResponseHandler(struct HostContext *host,
   char *responseMsg = malloc(sizeof(char) * MAX_MSG_LENGTH);
   memset(responseMsg, 0, MAX_MSG_LENGTH);
 
-  if (job_from_queue->timeToLive <= 0) {  // Handle expired job
+  if (job_from_queue->state == JOB_PENDING_STATE &&
+      job_from_queue->deadline <= current_time_ms()) {  // Handle expired job
     // Generate Expiration Notice for expired jobs
     switch (job_from_queue->packet->type) {
       case PKT_PING_REQ:
@@ -719,12 +753,9 @@ void jobWaitForResponseHandler(struct HostContext *host,
     job_delete(host->_id, job_from_queue);
 
   } else {  // Handle pending job
-    // Decrement time to live every time it's processed
-    job_from_queue->timeToLive--;
-
     if (job_from_queue->state == JOB_PENDING_STATE) {
-      // Re-enqueue job while pending and ttl > 0
-      job_enqueue(host->_id, *host->jobq, job_from_queue);
+      // Park job again while pending and its deadline has not passed
+      timer_wheel_add(&host->timers, job_from_queue, job_from_queue->deadline);
 
     } else {
       // Handle non-expired non-pending jobs according to their packet type
@@ -759,7 +790,8 @@ void jobWaitForResponseHandler(struct HostContext *host,
 
         case PKT_DOWNLOAD_REQ:
           if (job_from_queue->state == JOB_READY_STATE) {
-            job_enqueue(host->_id, *host->jobq, job_from_queue);
+            timer_wheel_add(&host->timers, job_from_queue,
+                            job_from_queue->deadline);
           } else if (job_from_queue->state == JOB_ERROR_STATE) {
             colorSnprintf(responseMsg, MAX_MSG_LENGTH, BOLD_RED, "%s",
                           job_from_queue->errorMsg);
@@ -791,7 +823,8 @@ void jobWaitForResponseHandler(struct HostContext *host,
             // Get domain name from original packet
             char *id = (char *)malloc(sizeof(char) * (JIDLEN + 1));
             char *dname = (char *)malloc(sizeof(char) * MAX_NAME_LEN);
-            parsePacket(job_from_queue->packet->payload, id, dname);
+            parsePacket(job_from_queue->packet->payload, id, dname,
+                        MAX_NAME_LEN);
             // get resolved hostId from query response
             int resolvedHostId = atoi(job_from_queue->errorMsg);
             // Update local cache with host id belonging to domain name
@@ -825,9 +858,13 @@ int parseManMsg(char *msg, char *cmd, char *dstStr, char *fname) {
 
 /* parsePacket:
  * parse a packet payload inputStr into its ticket and data
- * Note:: Use dynamically allocated buffers for ticket and data */
-void parsePacket(const char *inputStr, char *ticketStr, char *dataStr) {
+ * Note:: ticketStr must hold JIDLEN + 1 chars and dataStr dataSize chars;
+ * data that does not fit is cut short, and both are left empty on error */
+void parsePacket(const char *inputStr, char *ticketStr, char *dataStr,
+                 int dataSize) {
   const char delim = ':';
+  ticketStr[0] = '\0';
+  dataStr[0] = '\0';
 
   int inputLen = strnlen(inputStr, PACKET_PAYLOAD_MAX);
   if (inputLen == 0) {
@@ -854,6 +891,10 @@ void parsePacket(const char *inputStr, char *ticketStr, char *dataStr) {
     fprintf(stderr, "ERROR: parsePacket: delimiter not found in inputStr\n");
     return;
   }
+  if (delimPos > JIDLEN) {
+    fprintf(stderr, "ERROR: parsePacket: ticket longer than JIDLEN\n");
+    return;
+  }
 
   // Copy ticket from inputStr into ticketStr
   for (int i = 0; i < delimPos; i++) {
@@ -862,10 +903,14 @@ void parsePacket(const char *inputStr, char *ticketStr, char *dataStr) {
   ticketStr[delimPos] = '\0';
 
   // Copy data from inputStr into dataStr
-  for (int i = delimPos + 1; i < inputLen; i++) {
-    dataStr[i - delimPos - 1] = inputStr[i];
+  int dataLen = inputLen - delimPos - 1;
+  if (dataLen > dataSize - 1) {
+    dataLen = dataSize - 1;
   }
-  dataStr[inputLen - delimPos - 1] = '\0';
+  for (int i = 0; i < dataLen; i++) {
+    dataStr[i] = inputStr[delimPos + 1 + i];
+  }
+  dataStr[dataLen] = '\0';
 }  // End of parsePacket()
 
 void pktIncomingRequest(struct HostContext *host, struct Packet *inPkt) {
@@ -891,12 +936,12 @@ void pktIncomingRequest(struct HostContext *host, struct Packet *inPkt) {
   inPkt->src = host->_id;
 
   // Grab jid from request packet payload
-  char *id = (char *)malloc(sizeof(char) * JIDLEN);
+  char *id = (char *)malloc(sizeof(char) * (JIDLEN + 1));
   char *msg = (char *)malloc(sizeof(char) * MAX_RESPONSE_LEN);
-  parsePacket(inPkt->payload, id, msg);
+  parsePacket(inPkt->payload, id, msg, MAX_RESPONSE_LEN);
 
   struct Job *sendRespJob =
-      job_create(id, TIMETOLIVE, JOB_SEND_RESPONSE, JOB_PENDING_STATE, inPkt);
+      job_create(id, JOB_SEND_RESPONSE, JOB_PENDING_STATE, inPkt);
   job_enqueue(host->_id, *host->jobq, sendRespJob);
 
   free(id);
@@ -905,12 +950,12 @@ void pktIncomingRequest(struct HostContext *host, struct Packet *inPkt) {
 
 void pktIncomingResponse(struct HostContext *host, struct Packet *inPkt) {
   // Grab jid from request packet payload
-  char *id = (char *)malloc(sizeof(char) * JIDLEN);
+  char *id = (char *)malloc(sizeof(char) * (JIDLEN + 1));
   char *msg = (char *)malloc(sizeof(char) * MAX_RESPONSE_LEN);
-  parsePacket(inPkt->payload, id, msg);
+  parsePacket(inPkt->payload, id, msg, MAX_RESPONSE_LEN);
 
-  // Look for job id in job queue
-  struct Job *waitJob = job_queue_find_id(*host->jobq, id);
+  // Look for the job waiting on this response
+  struct Job *waitJob = findJob(host, id);
   if (waitJob != NULL) {
     // job id was found in queue
     switch (inPkt->type) {
@@ -958,6 +1003,7 @@ void pktIncomingResponse(struct HostContext *host, struct Packet *inPkt) {
         }
         break;
     }
+    wakeJob(host, waitJob);
   } else {
     // job id was not found in queue
     colorPrint(GREY, "Host%d received a response with an unrecognized job id\n",
@@ -970,14 +1016,94 @@ void pktIncomingResponse(struct HostContext *host, struct Packet *inPkt) {
   packet_delete(inPkt);
 }  // End of pktIncomingResponse()
 
+/*
+Receives every packet waiting on portNum and hands the ones addressed to this
+host to their handlers. The port is drained until no whole packet is left.
+*/
+void pktReceiveFromPort(struct HostContext *host, int portNum) {
+  struct Net_port *port = host->node_port_array[portNum];
+
+  while (1) {
+    struct Packet *inPkt = packet_pool_get(&host->pktPool);
+    int n = packet_recv(port, inPkt);
+    if (n <= 0) {
+      packet_delete(inPkt);
+      return;
+    }
+
+    if ((int)inPkt->dst != host->_id && inPkt->type != PKT_CONTROL) {
+      // No packet addressed to host received
+      packet_delete(inPkt);
+    } else {
+      if (inPkt->type != PKT_CONTROL) {
+#ifdef HOST_DEBUG_PACKET_RECEIPT
+        colorPrint(MAGENTA, "Host%d received packet: ", host->_id);
+        printPacket(inPkt);
+#endif
+      }
+
+      switch (inPkt->type) {
+        case PKT_CONTROL:
+          if (controlPacketReceived_endpoint(host->_id, port, inPkt,
+                                             host->numCtrlMsgsSent)) {
+            host->numCtrlMsgsSent++;
+            host->timeLastCtrlMsg = current_time_ms();
+          }
+          packet_delete(inPkt);
+          break;
+
+        case PKT_PING_REQ:
+        case PKT_UPLOAD_REQ:
+          pktIncomingRequest(host, inPkt);
+          break;
+
+        case PKT_DOWNLOAD_REQ: {
+          char *id = (char *)malloc(sizeof(char) * (JIDLEN + 1));
+          char *fname = (char *)malloc(sizeof(char) * MAX_RESPONSE_LEN);
+          parsePacket(inPkt->payload, id, fname, MAX_RESPONSE_LEN);
+          commandUploadHandler(host, inPkt->src, fname);
+          free(id);
+          free(fname);
+          packet_delete(inPkt);
+          break;
+        }
+
+        case PKT_PING_RESPONSE:
+        case PKT_UPLOAD_RESPONSE:
+        case PKT_DOWNLOAD_RESPONSE:
+        case PKT_DNS_REGISTRATION_RESPONSE:
+        case PKT_DNS_QUERY_RESPONSE:
+          pktIncomingResponse(host, inPkt);
+          break;
+
+        case PKT_UPLOAD:
+          pktUploadReceive(host, inPkt);
+          break;
+
+        case PKT_UPLOAD_END:
+          pktUploadEnd(host, inPkt);
+          packet_delete(inPkt);
+          break;
+
+        default:
+          fprintf(stderr, "Host%d received a packet of unknown type\n",
+                  host->_id);
+          packet_delete(inPkt);
+          break;
+      }  // end of switch
+    }
+  }
+}  // End of pktReceiveFromPort()
+
 void pktUploadEnd(struct HostContext *host, struct Packet *pkt) {
-  char *id = (char *)malloc(sizeof(char) * JIDLEN);
+  char *id = (char *)malloc(sizeof(char) * (JIDLEN + 1));
   char *msg = (char *)malloc(sizeof(char) * MAX_RESPONSE_LEN);
-  parsePacket(pkt->payload, id, msg);
+  parsePacket(pkt->payload, id, msg, MAX_RESPONSE_LEN);
 
-  struct Job *r = job_queue_find_id(*host->jobq, id);
+  struct Job *r = findJob(host, id);
   if (r != NULL) {
     r->state = JOB_COMPLETE_STATE;
+    wakeJob(host, r);
   } else {
     fprintf(stderr, "Request not found for ticket %s\n", id);
   }
@@ -994,14 +1120,18 @@ void pktUploadEnd(struct HostContext *host, struct Packet *pkt) {
 }  // End of pktUploadEnd()
 
 void pktUploadReceive(struct HostContext *host, struct Packet *pkt) {
-  char *id = (char *)malloc(sizeof(char) * JIDLEN);
+  char *id = (char *)malloc(sizeof(char) * (JIDLEN + 1));
   char *msg = (char *)malloc(sizeof(char) * MAX_RESPONSE_LEN);
-  parsePacket(pkt->payload, id, msg);
+  parsePacket(pkt->payload, id, msg, MAX_RESPONSE_LEN);
 
-  struct Job *rjob = job_queue_find_id(*host->jobq, id);
+  struct Job *rjob = findJob(host, id);
   if (rjob != NULL) {
-    // Refresh timeToLive of request
-    rjob->timeToLive = TIMETOLIVE;
+    // Push back the deadline of the request while data keeps arriving
+    if (rjob->timerSlot >= 0) {
+      timer_wheel_remove(&host->timers, rjob);
+      timer_wheel_add(&host->timers, rjob,
+                      current_time_ms() + RESPONSE_TIMEOUT_MS);
+    }
 
     if (rjob->fp == NULL) {
       // Open the file in append mode if it hasn't been opened already
@@ -1033,6 +1163,9 @@ void sendMsgToManager(int fd, char msg[MAX_MSG_LENGTH]) {
 
 int sendPacketTo(struct Net_port **node_port_array, int node_port_array_size,
                  struct Packet *p) {
+  // Replies reuse the packet they answer, so the hop count starts over
+  p->hops = 0;
+
   // Find which Net_port entry in net_port_array has desired destination
   int destIndex = -1;
   for (int i = 0; i < node_port_array_size; i++) {
@@ -1054,7 +1187,7 @@ int sendPacketTo(struct Net_port **node_port_array, int node_port_array_size,
 /*
 Attempts to convert the 'name' argument to an integer and returns the integer
 value if successful. If 'name' cannot be converted, searches the local
-nametable array for a matching entry and returns its index. Returns -1 if no
+nametable for a matching entry and returns its node id. Returns -1 if no
 match found.
 */
 int resolveHostname(struct HostContext *host, char *name) {
@@ -1066,41 +1199,33 @@ int resolveHostname(struct HostContext *host, char *name) {
     return value;
   }
 
-  // Search nametable for matching entry
-  for (int i = 0; i < MAX_NUM_NAMES; i++) {
-    if (host->nametable[i] != NULL && strcmp(name, host->nametable[i]) == 0) {
-      return i;
-    }
-  }
-
-  // No match found
-  return -1;
+  // Search nametable for matching entry, -1 if no match found
+  return nametable_find(&host->nametable, name);
 }  // End of resolveHostname()
 
 int requestIDFromDNS(struct HostContext *host, char *nameToResolve) {
   int nameLen = strlen(nameToResolve);
 
   // Create DNS Query Packet
-  struct Packet *p = createPacket(host->_id, STATIC_DNS_ID, PKT_DNS_QUERY,
+  struct Packet *p = createPacket(host->_id, host->dnsId, PKT_DNS_QUERY,
                                   nameLen, nameToResolve);
   // Create DNS Query Job
-  struct Job *j =
-      job_create(NULL, TIMETOLIVE, JOB_SEND_PKT, JOB_PENDING_STATE, p);
+  struct Job *j = job_create(NULL, JOB_SEND_PKT, JOB_PENDING_STATE, p);
   job_enqueue(host->_id, *host->jobq, j);
 
   // Create a deep copy of DNS Query Packet to keep as reference
   struct Packet *p2 = deepcopy_packet(p);
   // Create a job for waiting for response
-  struct Job *j2 = job_create(j->jid, TIMETOLIVE, JOB_WAIT_FOR_RESPONSE,
-                              JOB_PENDING_STATE, p2);
-  job_enqueue(host->_id, *host->jobq, j2);
+  struct Job *j2 =
+      job_create(j->jid, JOB_WAIT_FOR_RESPONSE, JOB_PENDING_STATE, p2);
+  timer_wheel_add(&host->timers, j2, current_time_ms() + RESPONSE_TIMEOUT_MS);
   return 0;
 }  // End of requestIDFromDNS()
 
 int updateNametable(struct HostContext *host, int hostId,
                     char name[MAX_NAME_LEN]) {
   // Update the nametable
-  strcpy(host->nametable[hostId], name);
+  nametable_set(&host->nametable, hostId, name);
 
 #ifdef HOST_DEBUG
   colorPrint(GREY, "\tlocal cache nametable for host%d updated: [%d]::\"%s\"\n",
@@ -1108,4 +1233,37 @@ int updateNametable(struct HostContext *host, int hostId,
 #endif
 
   return 0;
-}  // End of updateNametable()
\ No newline at end of file
+}  // End of updateNametable()
+
+/*
+Runs once per HOST_TICK_MS while jobs wait for responses, and otherwise once
+per STP keepalive. Sends the STP control packets and moves the waiting jobs
+whose deadline has passed back onto the job queue, where
+jobWaitForResponseHandler() reports them as timed out.
+*/
+void timerTickHandler(struct HostContext *host) {
+  // Send the first STP control packet, then keepalives; a tick may come a
+  // little early, so allow for one HOST_TICK_MS
+  long long timeNow = current_time_ms();
+  if (host->numCtrlMsgsSent == 0 ||
+      (stp_hello_interval_ms() > 0 &&
+       timeNow - host->timeLastCtrlMsg >= STP_HELLO_MS - HOST_TICK_MS)) {
+    controlPacketSender_endpoint(host->_id, host->node_port_array,
+                                 host->node_port_array_size,
+                                 host->numCtrlMsgsSent++);
+    host->timeLastCtrlMsg = timeNow;
+  }
+
+  timer_wheel_advance(&host->timers, timeNow, *host->jobq);
+}  // End of timerTickHandler()
+
+/*
+Moves a job parked in the timer wheel onto the job queue once the response it
+was waiting on has changed its state. Jobs already in the queue are left alone.
+*/
+void wakeJob(struct HostContext *host, struct Job *job) {
+  if (job->timerSlot >= 0) {
+    timer_wheel_remove(&host->timers, job);
+    job_enqueue(host->_id, *host->jobq, job);
+  }
+}  // End of wakeJob()
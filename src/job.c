@@ -19,10 +19,6 @@ char *get_job_type_literal(enum JobType t) {
   switch (t) {
     case JOB_SEND_PKT:
       return "JOB_SEND_PKT";
-    case JOB_BROADCAST_PKT:
-      return "JOB_BROADCAST_PKT";
-    case JOB_FORWARD_PKT:
-      return "JOB_FORWARD_PKT";
     case JOB_SEND_REQUEST:
       return "JOB_SEND_REQUEST";
     case JOB_SEND_RESPONSE:
@@ -69,13 +65,13 @@ void job_enqueue(int host_id, struct JobQueue *jq, struct Job *jobToEnqueue) {
   }
 #endif
 
+  jobToEnqueue->next = NULL;
   if (jq->head == NULL) {
     jq->head = jobToEnqueue;
     jq->tail = jobToEnqueue;
     jq->occ = 1;
   } else {
     (jq->tail)->next = jobToEnqueue;
-    jobToEnqueue->next = NULL;
     jq->tail = jobToEnqueue;
     jq->occ++;
   }
@@ -95,6 +91,10 @@ struct Job *job_dequeue(int host_id, struct JobQueue *jq) {
 #endif
 
   jq->head = (jq->head)->next;
+  if (jq->head == NULL) {
+    jq->tail = NULL;
+  }
+  j->next = NULL;
   jq->occ--;
   return (j);
 }  // End of job_dequeue()
@@ -104,17 +104,16 @@ struct Job *job_dequeue(int host_id, struct JobQueue *jq) {
  * if no ID is provided. It initializes all other properties to the given
  * values, prepends the job ID to the packet payload if provided, and returns a
  * pointer to the new job*/
-struct Job *job_create(const char *jid, int timeToLive, enum JobType type,
-                       enum JobState state, struct Packet *packet) {
+struct Job *job_create(const char *jid, enum JobType type, enum JobState state,
+                       struct Packet *packet) {
   struct Job *j = job_create_empty();
   if (jid == NULL) {
-    char t[JIDLEN];
+    char t[JIDLEN + 1];
     job_jid_gen(t);
     strncpy(j->jid, t, JIDLEN);
   } else {
     strncpy(j->jid, jid, JIDLEN);
   }
-  j->timeToLive = timeToLive;
   j->type = type;
   j->state = state;
   j->packet = packet;
@@ -142,8 +141,10 @@ struct Job *job_create_empty() {
     fprintf(stderr, "Failed to allocate memory for job\n");
     exit(EXIT_FAILURE);
   }
-  memset(j->jid, 0, (sizeof(char) * JIDLEN));
-  j->timeToLive = 0;
+  memset(j->jid, 0, sizeof(j->jid));
+  j->deadline = 0;
+  j->timerTick = 0;
+  j->timerSlot = -1;
   j->fp = NULL;
   memset(j->filepath, 0, sizeof(j->filepath));
   j->fileOffset = 0;
@@ -151,6 +152,8 @@ struct Job *job_create_empty() {
   j->state = JOB_INVALID_STATE;
   j->packet = NULL;
   j->next = NULL;
+  j->prev = NULL;
+  j->indexNext = NULL;
   return j;
 }
 
@@ -179,18 +182,25 @@ void job_jid_gen(char *dst) {
  * it is added to the beginning of the payload */
 void job_prepend_jid_to_payload(char jid[JIDLEN], struct Packet *p) {
   if (strstr(p->payload, jid) == NULL) {
-    char pbuff[PACKET_PAYLOAD_MAX] = {0};
-    snprintf_s(pbuff, PACKET_PAYLOAD_MAX - 1, "%s:%s", jid, p->payload);
-    strncpy(p->payload, pbuff, PACKET_PAYLOAD_MAX);
-    p->length = strlen(pbuff);
+    // Shift the payload in place rather than copying the whole payload array
+    int jidLen = strnlen(jid, JIDLEN);
+    int length = strnlen(p->payload, PACKET_PAYLOAD_MAX);
+    if (jidLen + 1 + length > PACKET_PAYLOAD_MAX) {
+      length = PACKET_PAYLOAD_MAX - jidLen - 1;
+    }
+    memmove(p->payload + jidLen + 1, p->payload, length);
+    memcpy(p->payload, jid, jidLen);
+    p->payload[jidLen] = ':';
+    p->length = jidLen + 1 + length;
+    p->payload[p->length] = '\0';
   }
 }
 
-/* Prints the contents of a job with its job ID, time to live, file pointer,
+/* Prints the contents of a job with its job ID, deadline, file pointer,
  * type, state, and associated packet. */
 void printJob(struct Job *j) {
-  colorPrint(BLUE, "jid:%s ttl:%d fp:%p type:%s state:%s packet: ", j->jid,
-             j->timeToLive, j->fp, get_job_type_literal(j->type),
+  colorPrint(BLUE, "jid:%s deadline:%lld fp:%p type:%s state:%s packet: ",
+             j->jid, j->deadline, j->fp, get_job_type_literal(j->type),
              get_job_state_literal(j->state));
   if (j->packet == NULL) {
     printf("NULL\n");
@@ -251,4 +261,174 @@ int job_queue_delete_id(struct JobQueue *jq, const char *deljid) {
     curr = curr->next;
   }
   return 0;
-}
\ No newline at end of file
+}
+
+/* Initializes an empty timer wheel whose ticks are tickMs long, starting at
+ * wall-clock time nowMs. */
+void timer_wheel_init(struct TimerWheel *tw, long long nowMs, int tickMs) {
+  memset(tw->slots, 0, sizeof(tw->slots));
+  memset(tw->index, 0, sizeof(tw->index));
+  tw->startMs = nowMs;
+  tw->currentTick = 0;
+  tw->tickMs = tickMs;
+  tw->occ = 0;
+}
+
+/* timer_wheel_bucket:
+ * returns the index bucket that holds the jobs with ID jid */
+static struct Job **timer_wheel_bucket(struct TimerWheel *tw,
+                                       const char *jid) {
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < JIDLEN && jid[i] != '\0'; i++) {
+    hash = (hash ^ (unsigned char)jid[i]) * 16777619u;
+  }
+  return &tw->index[hash & (TIMER_WHEEL_INDEX_SIZE - 1)];
+}
+
+/* timer_wheel_unindex:
+ * unlinks job j from the index bucket of its ID */
+static void timer_wheel_unindex(struct TimerWheel *tw, struct Job *j) {
+  struct Job **link = timer_wheel_bucket(tw, j->jid);
+  while (*link != NULL && *link != j) {
+    link = &(*link)->indexNext;
+  }
+  if (*link != NULL) {
+    *link = j->indexNext;
+  }
+  j->indexNext = NULL;
+}
+
+/* timer_wheel_place:
+ * links job j into the slot its timerTick falls on. A job goes on the lowest
+ * level whose window still reaches its tick, and is cascaded down a level
+ * each time the level below it wraps around. */
+static void timer_wheel_place(struct TimerWheel *tw, struct Job *j) {
+  int level = 0;
+  int shift = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         (j->timerTick >> shift) - (tw->currentTick >> shift) >=
+             TIMER_WHEEL_SLOTS) {
+    level++;
+    shift += TIMER_WHEEL_BITS;
+  }
+
+  long long slotTick = j->timerTick >> shift;
+  if (slotTick - (tw->currentTick >> shift) >= TIMER_WHEEL_SLOTS) {
+    // Past the reach of the top level, park it in the farthest slot and let
+    // the next cascade place it again
+    slotTick = (tw->currentTick >> shift) + TIMER_WHEEL_SLOTS - 1;
+  }
+  int slot = (int)(slotTick & (TIMER_WHEEL_SLOTS - 1));
+
+  struct Job **head = &tw->slots[level][slot];
+  j->prev = NULL;
+  j->next = *head;
+  if (*head != NULL) {
+    (*head)->prev = j;
+  }
+  *head = j;
+  j->timerSlot = level * TIMER_WHEEL_SLOTS + slot;
+}
+
+/* Parks job j in the wheel until deadlineMs. Deadlines are rounded up to the
+ * next tick, so a job never expires early. */
+void timer_wheel_add(struct TimerWheel *tw, struct Job *j,
+                     long long deadlineMs) {
+  j->deadline = deadlineMs;
+  j->timerTick = (deadlineMs - tw->startMs + tw->tickMs - 1) / tw->tickMs;
+  if (j->timerTick <= tw->currentTick) {
+    // The current tick has already been expired
+    j->timerTick = tw->currentTick + 1;
+  }
+  timer_wheel_place(tw, j);
+
+  struct Job **bucket = timer_wheel_bucket(tw, j->jid);
+  j->indexNext = *bucket;
+  *bucket = j;
+  tw->occ++;
+}
+
+/* Takes job j back out of the wheel before its deadline. */
+void timer_wheel_remove(struct TimerWheel *tw, struct Job *j) {
+  if (j->timerSlot < 0) {
+    return;
+  }
+  if (j->prev != NULL) {
+    j->prev->next = j->next;
+  } else {
+    tw->slots[j->timerSlot / TIMER_WHEEL_SLOTS]
+             [j->timerSlot % TIMER_WHEEL_SLOTS] = j->next;
+  }
+  if (j->next != NULL) {
+    j->next->prev = j->prev;
+  }
+  j->next = NULL;
+  j->prev = NULL;
+  j->timerSlot = -1;
+  timer_wheel_unindex(tw, j);
+  tw->occ--;
+}
+
+/* Advances the wheel to wall-clock time nowMs and moves every job whose
+ * deadline has passed onto the expired queue. Returns the number of jobs
+ * that expired. */
+int timer_wheel_advance(struct TimerWheel *tw, long long nowMs,
+                        struct JobQueue *expired) {
+  long long targetTick = (nowMs - tw->startMs) / tw->tickMs;
+  int numExpired = 0;
+
+  if (tw->occ == 0 && targetTick > tw->currentTick) {
+    // Nothing to expire or cascade along the way
+    tw->currentTick = targetTick;
+    return 0;
+  }
+
+  while (tw->currentTick < targetTick) {
+    tw->currentTick++;
+
+    // Cascade the upper levels whose slot boundary was just crossed, top
+    // level first so its jobs can land on a level that is cascaded next
+    for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+      int shift = level * TIMER_WHEEL_BITS;
+      if ((tw->currentTick & ((1LL << shift) - 1)) != 0) {
+        continue;
+      }
+      int slot = (int)((tw->currentTick >> shift) & (TIMER_WHEEL_SLOTS - 1));
+      struct Job *j = tw->slots[level][slot];
+      tw->slots[level][slot] = NULL;
+      while (j != NULL) {
+        struct Job *next = j->next;
+        timer_wheel_place(tw, j);
+        j = next;
+      }
+    }
+
+    // Every job on the lowest level's current slot is due this tick
+    int slot = (int)(tw->currentTick & (TIMER_WHEEL_SLOTS - 1));
+    struct Job *j = tw->slots[0][slot];
+    tw->slots[0][slot] = NULL;
+    while (j != NULL) {
+      struct Job *next = j->next;
+      j->prev = NULL;
+      j->timerSlot = -1;
+      timer_wheel_unindex(tw, j);
+      tw->occ--;
+      job_enqueue(-1, expired, j);
+      numExpired++;
+      j = next;
+    }
+  }
+  return numExpired;
+}
+
+/* Returns the number of jobs held by a timer wheel. */
+int timer_wheel_length(struct TimerWheel *tw) { return tw->occ; }
+
+/* Returns the job with a matching ID held by a timer wheel, or NULL. */
+struct Job *timer_wheel_find_id(struct TimerWheel *tw, const char *findjid) {
+  struct Job *j = *timer_wheel_bucket(tw, findjid);
+  while (j != NULL && strncmp(j->jid, findjid, JIDLEN) != 0) {
+    j = j->indexNext;
+  }
+  return j;
+}
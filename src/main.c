@@ -4,15 +4,21 @@
 
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "color.h"
 #include "constants.h"
+#include "eventLoop.h"
 #include "host.h"
 #include "manager.h"
 #include "net.h"
+#include "scheduler.h"
 #include "switch.h"
+#include "uring.h"
 #include "nameServer.h"
 
 #define BCAST_ADDR 100
@@ -25,6 +31,72 @@ void main(int argc, char **argv)
   int status;
   struct Net_node *node_list;
   struct Net_node *p_node;
+  char *confFile = NULL;
+  int numThreads = 0;
+  int virtualTime = 0;
+
+  /*
+   * Command line:
+   *   ./net367 [--threads N] [--virtual-time] [--io-uring] [--ecmp]
+   *            [config file]
+   * With --threads, every node runs as a task on N worker threads inside
+   * this process instead of in a forked process of its own.
+   * With --virtual-time, every node runs inside this process on a single
+   * simulation thread whose clock jumps from one timer to the next.
+   * With --io-uring, nodes read and write their pipe links through an
+   * io_uring of their own where the kernel supports it.
+   * With --ecmp, switches forward packets for known nodes along every
+   * shortest path instead of only along the spanning tree.
+   */
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+    {
+      numThreads = atoi(argv[++i]);
+      if (numThreads < 1)
+      {
+        fprintf(stderr, "Error: --threads needs a positive thread count\n");
+        return;
+      }
+    }
+    else if (strcmp(argv[i], "--virtual-time") == 0)
+    {
+      virtualTime = 1;
+    }
+    else if (strcmp(argv[i], "--io-uring") == 0)
+    {
+      uring_enable();
+    }
+    else if (strcmp(argv[i], "--ecmp") == 0)
+    {
+      switch_use_ecmp();
+    }
+    else
+    {
+      confFile = argv[i];
+    }
+  }
+
+  if (virtualTime)
+  {
+    /* Timers must be virtual before any node creates its event loop */
+    event_loop_use_virtual_time();
+    numThreads = 1;
+  }
+
+  if (numThreads > 0)
+  {
+    /*
+     * All links and node event loops now live in this one process, so let
+     * large topologies use every file descriptor the system allows.
+     */
+    struct rlimit fdLimit;
+    if (getrlimit(RLIMIT_NOFILE, &fdLimit) == 0)
+    {
+      fdLimit.rlim_cur = fdLimit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &fdLimit);
+    }
+  }
 
   /*
    * Read network configuration file, which specifies
@@ -32,12 +104,12 @@ void main(int argc, char **argv)
    *   - links, creates/implements the links, e.g., using pipes or sockets
    */
 
-  if (argc > 1)
+  if (confFile != NULL)
   {
     // ./net367 called with argument -> net_init with provided arg
-    if (net_init(argv[1]) != 0)
+    if (net_init(confFile) != 0)
     {
-      fprintf(stderr, "Error initializing network at net_init(%s)\n", argv[1]);
+      fprintf(stderr, "Error initializing network at net_init(%s)\n", confFile);
       return;
     }
   }
@@ -53,8 +125,40 @@ void main(int argc, char **argv)
 
   node_list = net_get_node_list(); /* Returns the list of nodes */
 
+  if (numThreads > 0)
+  {
+    /* Create nodes, which are tasks shared by the worker threads */
+    struct NodeTask *tasks = NULL;
+    for (p_node = node_list; p_node != NULL; p_node = p_node->next)
+    {
+      struct NodeTask *task = (struct NodeTask *)malloc(sizeof(struct NodeTask));
+      if (p_node->type == HOST)
+      {
+        host_task_init(task, p_node->id);
+      }
+      else if (p_node->type == SWITCH)
+      {
+        switch_task_init(task, p_node->id);
+      }
+      else if (p_node->type == DNS)
+      {
+        name_server_task_init(task, p_node->id);
+      }
+      task->next = tasks;
+      tasks = task;
+    }
+    int started = virtualTime ? scheduler_start_virtual(tasks)
+                              : scheduler_start(tasks, numThreads);
+    if (started != 0)
+    {
+      fprintf(stderr, "Error: main.c: failed to start the node scheduler\n");
+      return;
+    }
+  }
+
   /* Create nodes, which are child processes */
-  for (p_node = node_list; p_node != NULL; p_node = p_node->next)
+  for (p_node = node_list; numThreads == 0 && p_node != NULL;
+       p_node = p_node->next)
   {
     pid = fork();
     if (pid == -1)
@@ -11,25 +11,37 @@
 #include "color.h"
 #include "constants.h"
 #include "debug.h"
+#include "eventLoop.h"
 #include "host.h"
 #include "job.h"
 #include "net.h"
 #include "packet.h"
+#include "scheduler.h"
 #include "switch.h"
 
 // Used for registerNameToTable when ID can't be found
 #define UNKNOWN -1
 
+struct NameEntry {
+  int id;
+  char name[MAX_NAME_LEN + 1];
+  struct NameEntry *next;
+};
+
 struct NameServerContext {
   int _id;
   struct JobQueue **jobq;
   struct Net_port **node_port_array;
   int node_port_array_size;
   struct Net_port *node_port_list;
-  char **nametable;
+  struct NameTable nametable;
+  struct EventLoop loop;
+  unsigned int numCtrlMsgsSent;
+  struct PacketPool pktPool;
 };
 
 struct NameServerContext *initNameServerContext(int name_id);
+void receiveQueriesFromPort(struct NameServerContext *nsc, int portNum);
 int registerNameToTable(struct NameServerContext *nsc, struct Packet *pkt);
 int retrieveIdFromTable(struct NameServerContext *nsc, struct Packet *pkt);
 int sendPacketTo2(struct NameServerContext *nsc, struct Packet *p);
@@ -40,140 +52,124 @@ void name_server_main(int name_id) {
   ////// Initialize Name Server //////
   struct NameServerContext *nsc = initNameServerContext(name_id);
 
-  unsigned int numCtrlMsgsSent = 0;
-  static long long timeLast = 0;
-
+  int timeout = 0;
   while (1) {
-    ////////////////////////////////////////////////////////////////////////////
-    ////////////////////////////// PACKET HANDLER //////////////////////////////
-
-    // Periodically broadcast STP Control Packets
-    long long timeNow = current_time_ms();
-    if (timeNow - timeLast > PERIODIC_CTRL_MSG_WAITTIME_MS &&
-        numCtrlMsgsSent < ALLOWED_CONVERGENCE_ROUNDS) {
-      numCtrlMsgsSent++;
+    timeout = name_server_step(nsc, timeout) ? 0 : -1;
+  } /* End of while loop */
+}  // End of name_server_main()
+
+/*
+Runs one wakeup of the name server: waits up to timeoutMs for a port or the
+STP timer, turns incoming registrations and queries into jobs and runs them.
+Returns 1 if jobs are still queued.
+*/
+int name_server_step(void *context, int timeoutMs) {
+  struct NameServerContext *nsc = (struct NameServerContext *)context;
+  struct Event events[EVENT_LOOP_MAX_EVENTS];
+
+  int numEvents =
+      event_loop_wait(&nsc->loop, events, EVENT_LOOP_MAX_EVENTS, timeoutMs);
+
+  ////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////// PACKET HANDLER //////////////////////////////
+
+  for (int e = 0; e < numEvents; e++) {
+    if (events[e].kind == EVENT_TIMER) {
+      // Periodically broadcast STP Control Packets as keepalives
       controlPacketSender_endpoint(nsc->_id, nsc->node_port_array,
-                                   nsc->node_port_array_size);
-      timeLast = timeNow;
+                                   nsc->node_port_array_size,
+                                   nsc->numCtrlMsgsSent++);
+    } else if (events[e].kind == EVENT_PORT) {
+      receiveQueriesFromPort(nsc, events[e].index);
     }
+  }
 
-    for (int portNum = 0; portNum < nsc->node_port_array_size; portNum++) {
-      struct Packet *inPkt = (struct Packet *)malloc(sizeof(struct Packet));
-      int n = packet_recv(nsc->node_port_array[portNum], inPkt);
-      if (n > 0) {
-        if (inPkt->type != PKT_CONTROL) {
-#ifdef NAMESERVER_DEBUG_PACKET_RECEIPT
-          colorPrint(BOLD_ORANGE, "name_server received packet: ", nsc->_id);
-          printPacket(inPkt);
-#endif
-        }
+  ////////////////////////////// PACKET HANDLER //////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////
 
-        // switch statement that differeniates from registration, and query
-        switch (inPkt->type) {
-          case PKT_DNS_REGISTRATION: {
-            struct Job *nsJob = job_create_empty();
-            nsJob->packet = inPkt;
-            nsJob->type = JOB_DNS_REGISTER;
-            nsJob->state = JOB_PENDING_STATE;
-            job_enqueue(name_id, *nsc->jobq, nsJob);
-            break;
-          }
-
-          case PKT_DNS_QUERY: {
-            struct Job *nsJob = job_create_empty();
-            nsJob->packet = inPkt;
-            nsJob->type = JOB_DNS_QUERY;
-            nsJob->state = JOB_PENDING_STATE;
-            job_enqueue(name_id, *nsc->jobq, nsJob);
-            break;
-          }
-        }
+  // -------------------------------------------------------------------------
 
-      } else {
-        // Nothing to receive on port, so discard malloc'd packet
-        packet_delete(inPkt);
-        inPkt = NULL;
-      }
-    }
+  ////////////////////////////////////////////////////////////////////////////
+  //////////////////////////////// JOB HANDLER ///////////////////////////////
+
+  while (job_queue_length(*nsc->jobq) > 0) {
+    /* Get a new job from the job queue */
+    struct Job *job_from_queue = job_dequeue(nsc->_id, *nsc->jobq);
+
+    // Allow shorthand alias for Job Handler scope
+    struct Packet *pkt = job_from_queue->packet;
 
-    ////////////////////////////// PACKET HANDLER //////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////
-
-    // -------------------------------------------------------------------------
-
-    ////////////////////////////////////////////////////////////////////////////
-    //////////////////////////////// JOB HANDLER ///////////////////////////////
-
-    if (job_queue_length(*nsc->jobq) > 0) {
-      /* Get a new job from the job queue */
-      struct Job *job_from_queue = job_dequeue(name_id, *nsc->jobq);
-
-      // Allow shorthand alias for Job Handler scope
-      struct Packet *pkt = job_from_queue->packet;
-
-      //////////// EXECUTE FETCHED JOB ////////////
-      switch (job_from_queue->type) {
-        case JOB_DNS_REGISTER: {
-          int regSuccess = registerNameToTable(nsc, pkt);
-
-          // Repurpose the job_from_queue->packet for the response //
-          char prefix[JIDLEN + 2] = {0};
-          for (int i = 0; i < JIDLEN + 1; i++) {
-            // grab Job ID and demarcator for response
-            prefix[i] = pkt->payload[i];
-          }
-          char remsg[PACKET_PAYLOAD_MAX];
-          snprintf(remsg, PACKET_PAYLOAD_MAX, "%s%s", prefix,
-                   (regSuccess < 0) ? "FAILED" : "OK");
-          pkt->dst = pkt->src;
-          pkt->src = STATIC_DNS_ID;
-          pkt->type = PKT_DNS_REGISTRATION_RESPONSE;
-          pkt->length = strnlen(remsg, PACKET_PAYLOAD_MAX);
-          strncpy(job_from_queue->packet->payload, remsg, PACKET_PAYLOAD_MAX);
-
-          // Repurpose the job_from_queue job for the response
-          job_from_queue->type = JOB_SEND_PKT;
-          job_enqueue(nsc->_id, *nsc->jobq, job_from_queue);
-          break;
+    //////////// EXECUTE FETCHED JOB ////////////
+    switch (job_from_queue->type) {
+      case JOB_DNS_REGISTER: {
+        int regSuccess = registerNameToTable(nsc, pkt);
+
+        // Repurpose the job_from_queue->packet for the response //
+        char prefix[JIDLEN + 2] = {0};
+        for (int i = 0; i < JIDLEN + 1; i++) {
+          // grab Job ID and demarcator for response
+          prefix[i] = pkt->payload[i];
         }
-        case JOB_DNS_QUERY: {
-          int resolvedId = retrieveIdFromTable(nsc, pkt);
-
-          // Repurpose the job_from_queue->packet for the response //
-          char prefix[JIDLEN + 2] = {0};
-          for (int i = 0; i < JIDLEN + 1; i++) {
-            // grab Job ID and demarcator for response
-            prefix[i] = pkt->payload[i];
-          }
-          char remsg[PACKET_PAYLOAD_MAX] = {0};
-          snprintf(remsg, PACKET_PAYLOAD_MAX, "%s%d", prefix, resolvedId);
-          pkt->dst = pkt->src;
-          pkt->src = STATIC_DNS_ID;
-          pkt->type = PKT_DNS_QUERY_RESPONSE;
-          pkt->length = strnlen(remsg, PACKET_PAYLOAD_MAX);
-          strncpy(job_from_queue->packet->payload, remsg, PACKET_PAYLOAD_MAX);
-
-          // Repurpose the job_from_queue job for the response
-          job_from_queue->type = JOB_SEND_PKT;
-          job_enqueue(nsc->_id, *nsc->jobq, job_from_queue);
-
-          break;
+        char remsg[PACKET_PAYLOAD_MAX];
+        snprintf(remsg, PACKET_PAYLOAD_MAX, "%s%s", prefix,
+                 (regSuccess < 0) ? "FAILED" : "OK");
+        pkt->dst = pkt->src;
+        pkt->src = nsc->_id;
+        pkt->type = PKT_DNS_REGISTRATION_RESPONSE;
+        pkt->length = strnlen(remsg, PACKET_PAYLOAD_MAX);
+        strncpy(job_from_queue->packet->payload, remsg, PACKET_PAYLOAD_MAX);
+
+        // Repurpose the job_from_queue job for the response
+        job_from_queue->type = JOB_SEND_PKT;
+        job_enqueue(nsc->_id, *nsc->jobq, job_from_queue);
+        break;
+      }
+      case JOB_DNS_QUERY: {
+        int resolvedId = retrieveIdFromTable(nsc, pkt);
+
+        // Repurpose the job_from_queue->packet for the response //
+        char prefix[JIDLEN + 2] = {0};
+        for (int i = 0; i < JIDLEN + 1; i++) {
+          // grab Job ID and demarcator for response
+          prefix[i] = pkt->payload[i];
         }
+        char remsg[PACKET_PAYLOAD_MAX] = {0};
+        snprintf(remsg, PACKET_PAYLOAD_MAX, "%s%d", prefix, resolvedId);
+        pkt->dst = pkt->src;
+        pkt->src = nsc->_id;
+        pkt->type = PKT_DNS_QUERY_RESPONSE;
+        pkt->length = strnlen(remsg, PACKET_PAYLOAD_MAX);
+        strncpy(job_from_queue->packet->payload, remsg, PACKET_PAYLOAD_MAX);
+
+        // Repurpose the job_from_queue job for the response
+        job_from_queue->type = JOB_SEND_PKT;
+        job_enqueue(nsc->_id, *nsc->jobq, job_from_queue);
+
+        break;
+      }
 
-        case JOB_SEND_PKT: {
-          sendPacketTo2(nsc, job_from_queue->packet);
-          job_delete(nsc->_id, job_from_queue);
-        }
+      case JOB_SEND_PKT: {
+        sendPacketTo2(nsc, job_from_queue->packet);
+        job_delete(nsc->_id, job_from_queue);
       }
     }
+  }
 
-    //////////////////////////////// JOB HANDLER ///////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////
+  //////////////////////////////// JOB HANDLER ///////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////
 
-    /* The host goes to sleep for 10 ms */
-    usleep(LOOP_SLEEP_TIME_US);
-  } /* End of while loop */
-}  // End of name_server_main()
+  packet_flush(nsc->node_port_array, nsc->node_port_array_size);
+  event_loop_flush(&nsc->loop);
+  return job_queue_length(*nsc->jobq) > 0 || event_loop_pending(&nsc->loop);
+}  // End of name_server_step()
+
+void name_server_task_init(struct NodeTask *task, int name_id) {
+  struct NameServerContext *nsc = initNameServerContext(name_id);
+  task->id = name_id;
+  task->context = nsc;
+  task->step = name_server_step;
+  task->loop = &nsc->loop;
+}  // End of name_server_task_init()
 
 //////////////////////////////////////////////////////////////////////////
 /////////////////////// HELPER FUNCTIONS /////////////////////////////////
@@ -210,24 +206,166 @@ struct NameServerContext *initNameServerContext(int name_id) {
   // Initialize the JobQueue struct
   job_queue_init(*name_context->jobq);
 
-  name_context->nametable = malloc((MAX_NUM_NAMES + 1) * sizeof(char *));
-  init_nametable(name_context->nametable);
+  init_nametable(&name_context->nametable);
+
+  // Wake on incoming packets and on the STP control message timer
+  name_context->numCtrlMsgsSent = 0;
+  packet_pool_init(&name_context->pktPool);
+  if (event_loop_init(&name_context->loop) < 0) {
+    exit(EXIT_FAILURE);
+  }
+  for (int portNum = 0; portNum < name_context->node_port_array_size;
+       portNum++) {
+    event_loop_add_port(&name_context->loop,
+                        name_context->node_port_array[portNum], portNum);
+  }
+  event_loop_arm_timer(&name_context->loop, 1, stp_hello_interval_ms());
 
   return name_context;
 }  // End of initNameServerContext()
 
-void init_nametable(char **nametable) {
-  for (int i = 0; i <= MAX_NUM_NAMES; i++) {
-    nametable[i] = malloc(PACKET_PAYLOAD_MAX + 1);
-    nametable[i][0] = '\0';
-  }
+void init_nametable(struct NameTable *table) {
+  table->numBuckets = NAMETABLE_INITIAL_BUCKETS;
+  table->numNames = 0;
+  table->buckets = (struct NameEntry **)calloc(table->numBuckets,
+                                               sizeof(struct NameEntry *));
 }  // End of init_nametable()
 
+static unsigned int nametable_bucket(int id, int numBuckets) {
+  // Fibonacci hashing spreads sequential ids over the buckets
+  return ((unsigned int)id * 2654435769u) % (unsigned int)numBuckets;
+}  // End of nametable_bucket()
+
+static void nametable_grow(struct NameTable *table) {
+  int numBuckets = 2 * table->numBuckets;
+  struct NameEntry **buckets =
+      (struct NameEntry **)calloc(numBuckets, sizeof(struct NameEntry *));
+  for (int i = 0; i < table->numBuckets; i++) {
+    struct NameEntry *e = table->buckets[i];
+    while (e != NULL) {
+      struct NameEntry *next = e->next;
+      unsigned int b = nametable_bucket(e->id, numBuckets);
+      e->next = buckets[b];
+      buckets[b] = e;
+      e = next;
+    }
+  }
+  free(table->buckets);
+  table->buckets = buckets;
+  table->numBuckets = numBuckets;
+}  // End of nametable_grow()
+
+const char *nametable_get(struct NameTable *table, int id) {
+  struct NameEntry *e =
+      table->buckets[nametable_bucket(id, table->numBuckets)];
+  while (e != NULL) {
+    if (e->id == id) {
+      return e->name;
+    }
+    e = e->next;
+  }
+  return NULL;
+}  // End of nametable_get()
+
+void nametable_set(struct NameTable *table, int id, const char *name) {
+  if (id < 0) {
+    return;
+  }
+
+  unsigned int b = nametable_bucket(id, table->numBuckets);
+  struct NameEntry *e = table->buckets[b];
+  while (e != NULL && e->id != id) {
+    e = e->next;
+  }
+  if (e == NULL) {
+    e = (struct NameEntry *)malloc(sizeof(struct NameEntry));
+    e->id = id;
+    e->next = table->buckets[b];
+    table->buckets[b] = e;
+    if (++table->numNames > 2 * table->numBuckets) {
+      nametable_grow(table);
+    }
+  }
+  strncpy(e->name, name, MAX_NAME_LEN);
+  e->name[MAX_NAME_LEN] = '\0';
+}  // End of nametable_set()
+
+int nametable_find(struct NameTable *table, const char *name) {
+  int found = -1;
+  for (int i = 0; i < table->numBuckets; i++) {
+    for (struct NameEntry *e = table->buckets[i]; e != NULL; e = e->next) {
+      if ((found < 0 || e->id < found) &&
+          strncmp(name, e->name, MAX_NAME_LEN) == 0) {
+        found = e->id;
+      }
+    }
+  }
+  return found;
+}  // End of nametable_find()
+
+/*
+Receives every packet waiting on portNum and queues a job for each DNS
+registration or query. The port is drained until no whole packet is left.
+*/
+void receiveQueriesFromPort(struct NameServerContext *nsc, int portNum) {
+  struct Net_port *port = nsc->node_port_array[portNum];
+
+  while (1) {
+    struct Packet *inPkt = packet_pool_get(&nsc->pktPool);
+    int n = packet_recv(port, inPkt);
+    if (n <= 0) {
+      // Nothing to receive on port, so return packet to the pool
+      packet_delete(inPkt);
+      return;
+    }
+
+    if (inPkt->type != PKT_CONTROL) {
+#ifdef NAMESERVER_DEBUG_PACKET_RECEIPT
+      colorPrint(BOLD_ORANGE, "name_server received packet: ", nsc->_id);
+      printPacket(inPkt);
+#endif
+    }
+
+    // switch statement that differeniates from registration, and query
+    switch (inPkt->type) {
+      case PKT_DNS_REGISTRATION: {
+        struct Job *nsJob = job_create_empty();
+        nsJob->packet = inPkt;
+        nsJob->type = JOB_DNS_REGISTER;
+        nsJob->state = JOB_PENDING_STATE;
+        job_enqueue(nsc->_id, *nsc->jobq, nsJob);
+        break;
+      }
+
+      case PKT_DNS_QUERY: {
+        struct Job *nsJob = job_create_empty();
+        nsJob->packet = inPkt;
+        nsJob->type = JOB_DNS_QUERY;
+        nsJob->state = JOB_PENDING_STATE;
+        job_enqueue(nsc->_id, *nsc->jobq, nsJob);
+        break;
+      }
+
+      case PKT_CONTROL:
+        if (controlPacketReceived_endpoint(nsc->_id, port, inPkt,
+                                           nsc->numCtrlMsgsSent)) {
+          nsc->numCtrlMsgsSent++;
+        }
+        packet_delete(inPkt);
+        break;
+
+      default:
+        packet_delete(inPkt);
+        break;
+    }
+  }
+}  // End of receiveQueriesFromPort()
+
 int registerNameToTable(struct NameServerContext *nsc, struct Packet *pkt) {
   int index = pkt->src;
   int length = pkt->length;
 
-  if (index < 0 || index >= PACKET_PAYLOAD_MAX || length <= 0) {
+  if (index < 0 || length <= 0) {
     // Invalid input
     fprintf(stderr,
             "nameServer registerNameToTable encountered invalid index\n");
@@ -248,11 +386,11 @@ int registerNameToTable(struct NameServerContext *nsc, struct Packet *pkt) {
   dname[dnameLen] = '\0';
 
   // Update nametable to [src]::domainName
-  strncpy(nsc->nametable[pkt->src], dname, dnameLen);
+  nametable_set(&nsc->nametable, pkt->src, dname);
 
 #ifdef NAMESERVER_DEBUG
   colorPrint(BOLD_GREY, "\t%s was registered to host%d\n",
-             nsc->nametable[pkt->src], pkt->src);
+             nametable_get(&nsc->nametable, pkt->src), pkt->src);
 #endif
   return 0;
 }  // End of registerNameToTable()
@@ -268,16 +406,14 @@ int retrieveIdFromTable(struct NameServerContext *nsc, struct Packet *pkt) {
     dname[i] = pkt->payload[i + JIDLEN + 1];
   }
 
-  for (int i = 0; i < MAX_NUM_NAMES; i++) {
-    if (strncmp(dname, nsc->nametable[i], PACKET_PAYLOAD_MAX) == 0) {
-      return i;
-    }
-  }
-  // name wasn't found; return error
-  return -1;
+  // -1 if the name wasn't found
+  return nametable_find(&nsc->nametable, dname);
 }  // End of retrieveIdFromTable()
 
 int sendPacketTo2(struct NameServerContext *nsc, struct Packet *p) {
+  // Replies reuse the packet they answer, so the hop count starts over
+  p->hops = 0;
+
   // Find which Net_port entry in net_port_array has desired destination
   int destIndex = -1;
   for (int i = 0; i < nsc->node_port_array_size; i++) {
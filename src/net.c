@@ -21,11 +21,13 @@
 #include <unistd.h>
 #define _GNU_SOURCE
 #include <fcntl.h>
+#include <limits.h>
 
 #include "color.h"
 #include "host.h"
 #include "manager.h"
 #include "packet.h"
+#include "shmRing.h"
 #include "socket.h"
 
 #define PIPE_WRITE 1
@@ -97,9 +99,82 @@ struct Net_port *net_get_port_list(int id_of_interest)
   return result;
 }
 
+/* Return the fd that signals incoming data on port */
+int net_port_recv_fd(struct Net_port *port)
+{
+  if (port->type == SOCKET || port->type == LOCAL)
+  {
+    // Socket links start out accepting on their listening socket
+    return port->listen_fd;
+  }
+  return port->recv_fd;
+}
+
 /* Return the linked list of nodes */
 struct Net_node *net_get_node_list() { return g_node_list; }
 
+/* Return the id of the configuration's DNS server */
+int net_get_dns_id()
+{
+  for (int i = 0; i < net_node_num; i++)
+  {
+    if (net_node_list[i].type == DNS)
+    {
+      return net_node_list[i].id;
+    }
+  }
+  return STATIC_DNS_ID;
+}
+
+/* Return the smallest MTU of the configuration's links */
+int net_get_min_mtu()
+{
+  int mtu = PACKET_PAYLOAD_MAX;
+  for (int i = 0; i < net_link_num; i++)
+  {
+    if (net_link_list[i].mtu < mtu)
+    {
+      mtu = net_link_list[i].mtu;
+    }
+  }
+  return mtu;
+}
+
+static int compare_node_ids(const void *a, const void *b)
+{
+  int idA = *(const int *)a;
+  int idB = *(const int *)b;
+  return (idA > idB) - (idA < idB);
+}
+
+/* Returns 0 if every node id is non-negative and unique, -1 otherwise */
+static int check_node_ids()
+{
+  int *ids = (int *)malloc(sizeof(int) * net_node_num);
+  for (int i = 0; i < net_node_num; i++)
+  {
+    ids[i] = net_node_list[i].id;
+  }
+  qsort(ids, net_node_num, sizeof(int), compare_node_ids);
+
+  int result = 0;
+  if (ids[0] < 0)
+  {
+    colorPrint(RED, " net.c: Negative node id %d\n", ids[0]);
+    result = -1;
+  }
+  for (int i = 1; i < net_node_num; i++)
+  {
+    if (ids[i] == ids[i - 1])
+    {
+      colorPrint(RED, " net.c: Node id %d is used more than once\n", ids[i]);
+      result = -1;
+    }
+  }
+  free(ids);
+  return result;
+}
+
 /* Return linked list of ports used by the manager to connect to hosts */
 struct Man_port_at_man *net_get_man_ports_at_man_list()
 {
@@ -293,6 +368,30 @@ void create_port_list()
     int node1 = net_link_list[i].node1;
     p0->link_node_id = node0;
     p1->link_node_id = node1;
+    p0->mtu = net_link_list[i].mtu;
+    p1->mtu = net_link_list[i].mtu;
+    p0->ring = NULL;
+    p1->ring = NULL;
+    p0->rxBuf = NULL;
+    p1->rxBuf = NULL;
+    p0->outBuf = NULL;
+    p1->outBuf = NULL;
+    p0->outStart = p0->outLen = p0->outFrameLeft = p0->outWatchWrite = 0;
+    p1->outStart = p1->outLen = p1->outFrameLeft = p1->outWatchWrite = 0;
+    p0->outInFlight = p1->outInFlight = 0;
+    p0->txLen = p0->txCount = 0;
+    p1->txLen = p1->txCount = 0;
+    p0->queuePolicy = net_link_list[i].queuePolicy;
+    p1->queuePolicy = net_link_list[i].queuePolicy;
+    p0->redAvgDepth = p1->redAvgDepth = 0;
+    p0->redSeed = 2 * i + 1;
+    p1->redSeed = 2 * i + 2;
+    memset(&p0->queueStats, 0, sizeof(p0->queueStats));
+    memset(&p1->queueStats, 0, sizeof(p1->queueStats));
+    p0->loop = NULL;
+    p1->loop = NULL;
+    p0->shmTx = p0->shmRx = NULL;
+    p1->shmTx = p1->shmRx = NULL;
     if (net_link_list[i].type == PIPE)
     {
       ////////////////////// PIPE ///////////////////////////
@@ -323,15 +422,91 @@ void create_port_list()
       p1->next = g_port_list;
       g_port_list = p0;
     }
+    else if (net_link_list[i].type == SHM)
+    {
+      ////////////////////// SHM ///////////////////////////
+      strncpy(p0->remoteDomain, "", MAX_DOMAIN_NAME_LENGTH);
+      p0->remotePort = -1;
+      strncpy(p1->remoteDomain, "", MAX_DOMAIN_NAME_LENGTH);
+      p1->remotePort = -1;
+      p0->type = net_link_list[i].type;
+      p1->type = net_link_list[i].type;
+      /* One ring per direction, mapped before the nodes are forked */
+      p0->shmTx = shm_ring_create();
+      p1->shmTx = shm_ring_create();
+      if (p0->shmTx == NULL || p1->shmTx == NULL)
+      {
+        exit(EXIT_FAILURE);
+      }
+      p1->shmRx = p0->shmTx;
+      p0->shmRx = p1->shmTx;
+      p0->send_fd = -1;
+      p1->send_fd = -1;
+      p0->recv_fd = shm_ring_fd(p0->shmRx);
+      p1->recv_fd = shm_ring_fd(p1->shmRx);
+      /* Insert ports in linked list */
+      p0->next = p1;
+      p1->next = g_port_list;
+      g_port_list = p0;
+    }
     else if (net_link_list[i].type == SOCKET)
     {
       ////////////////////// SOCKET ///////////////////////////
       free(p1);
       p1 = NULL;
       p0->type = net_link_list[i].type;
-      p0->send_fd = sock_server_init(net_link_list[i].socket_local_domain,
-                                     net_link_list[i].socket_local_port);
-      p0->recv_fd = 0;
+      p0->listen_fd = sock_server_init(net_link_list[i].socket_local_domain,
+                                       net_link_list[i].socket_local_port);
+      // Connections are opened once the link is first used
+      p0->send_fd = -1;
+      p0->recv_fd = -1;
+      p0->sockConnecting = 0;
+      p0->sockRetryMs = 0;
+      p0->sockBackoffMs = SOCKET_BACKOFF_MIN_MS;
+      strncpy(p0->localDomain, net_link_list[i].socket_local_domain,
+              MAX_DOMAIN_NAME_LENGTH);
+      strncpy(p0->remoteDomain, net_link_list[i].socket_remote_domain,
+              MAX_DOMAIN_NAME_LENGTH);
+      p0->remotePort = net_link_list[i].socket_remote_port;
+      /* Insert port into linked list */
+      p0->next = g_port_list;
+      g_port_list = p0;
+    }
+    else if (net_link_list[i].type == LOCAL)
+    {
+      ////////////////////// LOCAL ///////////////////////////
+      free(p1);
+      p1 = NULL;
+      p0->type = net_link_list[i].type;
+      p0->listen_fd =
+          sock_local_server_init(net_link_list[i].socket_local_domain);
+      // Connections are opened once the link is first used
+      p0->send_fd = -1;
+      p0->recv_fd = -1;
+      p0->sockConnecting = 0;
+      p0->sockRetryMs = 0;
+      p0->sockBackoffMs = SOCKET_BACKOFF_MIN_MS;
+      strncpy(p0->localDomain, net_link_list[i].socket_local_domain,
+              MAX_DOMAIN_NAME_LENGTH);
+      strncpy(p0->remoteDomain, net_link_list[i].socket_remote_domain,
+              MAX_DOMAIN_NAME_LENGTH);
+      p0->remotePort = -1;
+      /* Insert port into linked list */
+      p0->next = g_port_list;
+      g_port_list = p0;
+    }
+    else if (net_link_list[i].type == UDP)
+    {
+      ////////////////////// UDP ///////////////////////////
+      free(p1);
+      p1 = NULL;
+      p0->type = net_link_list[i].type;
+      // One bound socket, connected to the remote end, sends and receives
+      p0->send_fd = sock_udp_init(net_link_list[i].socket_local_domain,
+                                  net_link_list[i].socket_local_port,
+                                  net_link_list[i].socket_remote_domain,
+                                  net_link_list[i].socket_remote_port);
+      p0->recv_fd = p0->send_fd;
       strncpy(p0->localDomain, net_link_list[i].socket_local_domain,
               MAX_DOMAIN_NAME_LENGTH);
       strncpy(p0->remoteDomain, net_link_list[i].socket_remote_domain,
@@ -344,6 +519,70 @@ void create_port_list()
   }
 } // End of create_port_list()
 
+/* Returns the name of a queue policy as shown in the link list */
+static const char *queue_policy_literal(enum QueuePolicy policy)
+{
+  switch (policy)
+  {
+  case QUEUE_HEAD_DROP:
+    return "head-drop";
+  case QUEUE_RED:
+    return "RED";
+  default:
+    return "tail-drop";
+  }
+}
+
+/*
+Reads the rest of a link line, which may end with the link's MTU and its queue
+policy ("tail", "head" or "red"), into link. The MTU is DEFAULT_LINK_MTU if
+none is given, otherwise the given value limited to what the link type can
+carry in one packet. Ports drop from the tail of full queues by default.
+*/
+static void read_link_options(FILE *fp, int linkMax, struct Net_link *link)
+{
+  char rest[MAX_MSG_LENGTH];
+  int mtu = DEFAULT_LINK_MTU;
+  link->queuePolicy = QUEUE_TAIL_DROP;
+  if (fgets(rest, sizeof(rest), fp) == NULL)
+  {
+    rest[0] = '\0';
+  }
+  for (char *tok = strtok(rest, " \t\r\n"); tok != NULL;
+       tok = strtok(NULL, " \t\r\n"))
+  {
+    if (strcmp(tok, "tail") == 0)
+    {
+      link->queuePolicy = QUEUE_TAIL_DROP;
+    }
+    else if (strcmp(tok, "head") == 0)
+    {
+      link->queuePolicy = QUEUE_HEAD_DROP;
+    }
+    else if (strcmp(tok, "red") == 0)
+    {
+      link->queuePolicy = QUEUE_RED;
+    }
+    else if (sscanf(tok, "%d", &mtu) != 1)
+    {
+      colorPrint(RED, " net.c: Ignoring unknown link option %s\n", tok);
+    }
+  }
+  if (mtu < DEFAULT_LINK_MTU)
+  {
+    colorPrint(RED, " net.c: MTU %d raised to the minimum of %d\n", mtu,
+               DEFAULT_LINK_MTU);
+    mtu = DEFAULT_LINK_MTU;
+  }
+  else if (mtu > linkMax)
+  {
+    colorPrint(RED, " net.c: MTU %d lowered to the link maximum of %d\n", mtu,
+               linkMax);
+    mtu = linkMax;
+  }
+  link->mtu = mtu;
+} // End of read_link_options()
+
 /*
 - This function loads network configuration data from a file and stores it in
 two arrays, net_node_list and net_link_list.
@@ -425,6 +664,11 @@ int load_net_data_file(char *confFile)
       //   return (-1);
       // }
     }
+    if (check_node_ids() < 0)
+    {
+      fclose(fp);
+      return (-1);
+    }
   }
   int link_num;
   char link_type;
@@ -445,12 +689,19 @@ int load_net_data_file(char *confFile)
     for (i = 0; i < link_num; i++)
     {
       fscanf(fp, " %c ", &link_type);
-      if (link_type == 'P')
+      if (link_type == 'P' || link_type == 'M')
       {
-        net_link_list[i].type = PIPE;
-        fscanf(fp, " %d %d ", &node0, &node1);
+        net_link_list[i].type = (link_type == 'P') ? PIPE : SHM;
+        fscanf(fp, " %d %d", &node0, &node1);
         net_link_list[i].node0 = node0;
         net_link_list[i].node1 = node1;
+        // A pipe packet must also fit in one atomic pipe write
+        int linkMax = PACKET_PAYLOAD_MAX;
+        if (link_type == 'P' && PIPE_BUF - PACKET_HEADER_SIZE < linkMax)
+        {
+          linkMax = PIPE_BUF - PACKET_HEADER_SIZE;
+        }
+        read_link_options(fp, linkMax, &net_link_list[i]);
         // Set unused fields to empty
         strncpy(net_link_list[i].socket_local_domain, "",
                 MAX_DOMAIN_NAME_LENGTH);
@@ -459,15 +710,27 @@ int load_net_data_file(char *confFile)
                 MAX_DOMAIN_NAME_LENGTH);
         net_link_list[i].socket_remote_port = 0;
       }
-      else if (link_type == 'S')
+      else if (link_type == 'S' || link_type == 'U')
       {
-        net_link_list[i].type = SOCKET;
+        net_link_list[i].type = (link_type == 'S') ? SOCKET : UDP;
         fscanf(fp, "%d %s %d %s %d", &net_link_list[i].node0,
                net_link_list[i].socket_local_domain,
                &net_link_list[i].socket_local_port,
                net_link_list[i].socket_remote_domain,
                &net_link_list[i].socket_remote_port);
         net_link_list[i].node1 = -1;
+        read_link_options(fp, PACKET_PAYLOAD_MAX, &net_link_list[i]);
+      }
+      else if (link_type == 'L')
+      {
+        net_link_list[i].type = LOCAL;
+        fscanf(fp, "%d %98s %98s", &net_link_list[i].node0,
+               net_link_list[i].socket_local_domain,
+               net_link_list[i].socket_remote_domain);
+        net_link_list[i].node1 = -1;
+        net_link_list[i].socket_local_port = 0;
+        net_link_list[i].socket_remote_port = 0;
+        read_link_options(fp, PACKET_PAYLOAD_MAX, &net_link_list[i]);
       }
       else
       {
@@ -501,16 +764,42 @@ int load_net_data_file(char *confFile)
   {
     if (net_link_list[i].type == PIPE)
     {
-      colorPrint(PURPLE, " Link (%d, %d) PIPE\n", net_link_list[i].node0,
-                 net_link_list[i].node1);
+      colorPrint(PURPLE, " Link (%d, %d) PIPE MTU %d %s\n",
+                 net_link_list[i].node0, net_link_list[i].node1,
+                 net_link_list[i].mtu,
+                 queue_policy_literal(net_link_list[i].queuePolicy));
+    }
+    else if (net_link_list[i].type == SHM)
+    {
+      colorPrint(PURPLE, " Link (%d, %d) SHM MTU %d %s\n",
+                 net_link_list[i].node0, net_link_list[i].node1,
+                 net_link_list[i].mtu,
+                 queue_policy_literal(net_link_list[i].queuePolicy));
     }
     else if (net_link_list[i].type == SOCKET)
     {
-      colorPrint(PURPLE, " Link (%d, %s:%d, %s:%d) SOCKET\n",
+      colorPrint(PURPLE, " Link (%d, %s:%d, %s:%d) SOCKET MTU %d %s\n",
+                 net_link_list[i].node0, net_link_list[i].socket_local_domain,
+                 net_link_list[i].socket_local_port,
+                 net_link_list[i].socket_remote_domain,
+                 net_link_list[i].socket_remote_port, net_link_list[i].mtu,
+                 queue_policy_literal(net_link_list[i].queuePolicy));
+    }
+    else if (net_link_list[i].type == LOCAL)
+    {
+      colorPrint(PURPLE, " Link (%d, %s, %s) LOCAL MTU %d %s\n",
+                 net_link_list[i].node0, net_link_list[i].socket_local_domain,
+                 net_link_list[i].socket_remote_domain, net_link_list[i].mtu,
+                 queue_policy_literal(net_link_list[i].queuePolicy));
+    }
+    else if (net_link_list[i].type == UDP)
+    {
+      colorPrint(PURPLE, " Link (%d, %s:%d, %s:%d) UDP MTU %d %s\n",
                  net_link_list[i].node0, net_link_list[i].socket_local_domain,
                  net_link_list[i].socket_local_port,
                  net_link_list[i].socket_remote_domain,
-                 net_link_list[i].socket_remote_port);
+                 net_link_list[i].socket_remote_port, net_link_list[i].mtu,
+                 queue_policy_literal(net_link_list[i].queuePolicy));
     }
   }
   fclose(fp);
@@ -4,6 +4,9 @@
 
 #include "packet.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,55 +14,643 @@
 
 #include "color.h"
 #include "debug.h"
+#include "eventLoop.h"
 #include "host.h"
 #include "net.h"
+#include "shmRing.h"
 #include "socket.h"
+#include "switch.h"
+#include "uring.h"
 
-/* Receives a network packet through a pipe or socket by reading a message
- * buffer and then parsing it into a packet. */
-int packet_recv(struct Net_port *port, struct Packet *p) {
-  char pkt[PACKET_PAYLOAD_MAX + 4];
-  int bytesRead = 0;
+#if PACKET_PAYLOAD_MAX > 65535
+#error "PACKET_PAYLOAD_MAX must fit the 16-bit length of the wire header"
+#endif
+#if PACKET_PAYLOAD_MAX < DEFAULT_LINK_MTU
+#error "PACKET_PAYLOAD_MAX must be at least DEFAULT_LINK_MTU"
+#endif
+
+/*
+ * Wire format of a packet, multi-byte fields in big-endian order:
+ *   [0..3] src  [4..7] dst  [8] type  [9] hops  [10..11] payload length
+ *   payload
+ */
+
+static void packet_put32(char *buf, int value) {
+  uint32_t v = (uint32_t)value;
+  buf[0] = (char)(v >> 24);
+  buf[1] = (char)(v >> 16);
+  buf[2] = (char)(v >> 8);
+  buf[3] = (char)v;
+}
+
+static int packet_get32(const char *buf) {
+  const unsigned char *b = (const unsigned char *)buf;
+  return (int)(((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) |
+               ((uint32_t)b[2] << 8) | (uint32_t)b[3]);
+}
+
+/* Returns the payload length announced by a packet header. */
+static int packet_header_length(const char *frame) {
+  return ((unsigned char)frame[10] << 8) | (unsigned char)frame[11];
+}
+
+/* Makes room for len more bytes at the end of port's stream buffer. */
+static void packet_stream_reserve(struct Net_port *port, int len) {
+  if (port->rxBuf == NULL) {
+    port->rxCapacity = PACKET_STREAM_BUFFER;
+    port->rxBuf = (char *)malloc(port->rxCapacity);
+    port->rxStart = 0;
+    port->rxLen = 0;
+  }
+  if (port->rxStart + port->rxLen + len <= port->rxCapacity) {
+    return;
+  }
+  memmove(port->rxBuf, port->rxBuf + port->rxStart, port->rxLen);
+  port->rxStart = 0;
+  while (port->rxLen + len > port->rxCapacity) {
+    port->rxCapacity *= 2;
+    port->rxBuf = (char *)realloc(port->rxBuf, port->rxCapacity);
+  }
+}
+
+void packet_stream_append(struct Net_port *port, const char *buf, int len) {
+  packet_stream_reserve(port, len);
+  memcpy(port->rxBuf + port->rxStart + port->rxLen, buf, len);
+  port->rxLen += len;
+}
+
+/* Decodes the first whole packet in port's stream buffer into p. Returns its
+ * size on the wire, or 0 if it has not fully arrived yet. */
+static int packet_stream_take(struct Net_port *port, struct Packet *p) {
+  if (port->rxBuf == NULL || port->rxLen < PACKET_HEADER_SIZE) {
+    return 0;
+  }
+  const char *frame = port->rxBuf + port->rxStart;
+  int length = packet_header_length(frame);
+  if (length > PACKET_PAYLOAD_MAX) {
+    // The stream lost its framing; nothing buffered can be trusted
+    fprintf(stderr,
+            "\nError: packet_recv: bad frame length %d, dropping %d bytes\n",
+            length, port->rxLen);
+    port->rxStart = 0;
+    port->rxLen = 0;
+    return 0;
+  }
+  int frameLen = PACKET_HEADER_SIZE + length;
+  if (port->rxLen < frameLen) {
+    return 0;
+  }
+
+  p->src = packet_get32(frame);
+  p->dst = packet_get32(frame + 4);
+  p->type = frame[8];
+  p->hops = (unsigned char)frame[9];
+  p->length = length;
+  memcpy(p->payload, frame + PACKET_HEADER_SIZE, length);
+  // Payloads are often used as strings
+  p->payload[length] = '\0';
+
+  port->rxStart += frameLen;
+  port->rxLen -= frameLen;
+  if (port->rxLen == 0) {
+    port->rxStart = 0;
+  }
+  return frameLen;
+}
+
+/* Makes fd, a connection just accepted on a SOCKET or LOCAL port, the one the
+ * port receives on. The remote node keeps one connection open at a time, so
+ * the listening socket is not watched again until it closes. */
+static void packet_socket_adopt(struct Net_port *port, int fd) {
+  port->recv_fd = fd;
+  if (port->loop != NULL) {
+    event_loop_remove_fd(port->loop, port->listen_fd);
+    event_loop_add_fd(port->loop, fd, EVENT_PORT, port->loopIndex);
+  }
+  // The remote node is listening too, so connecting back need not wait out
+  // the backoff
+  port->sockRetryMs = 0;
+  port->sockBackoffMs = SOCKET_BACKOFF_MIN_MS;
+}
+
+/* Closes the connection a SOCKET or LOCAL port receives on, along with any
+ * partial packet it left behind, and waits for the remote node to connect
+ * again. */
+static void packet_socket_closed(struct Net_port *port) {
+  // Closing the connection also removes it from the event loop
+  close(port->recv_fd);
+  port->recv_fd = -1;
+  port->rxStart = 0;
+  port->rxLen = 0;
+  if (port->loop != NULL) {
+    event_loop_add_fd(port->loop, port->listen_fd, EVENT_PORT,
+                      port->loopIndex);
+  }
+}
+
+/* Reads what has arrived on a SOCKET port's connection into its stream
+ * buffer. While the port has no connection, the listening socket is what
+ * woke the node, so the remote node's connection is accepted first. Returns
+ * the number of bytes read, 0 if none. */
+static int packet_socket_read(struct Net_port *port) {
+  if (port->recv_fd < 0) {
+    int fd = sock_accept(port->listen_fd, port->remoteDomain);
+    if (fd < 0) {
+      return 0;
+    }
+    packet_socket_adopt(port, fd);
+  }
+
+  packet_stream_reserve(port, PACKET_TX_BATCH_BYTES);
+  int bytesRead =
+      sock_recv(port->recv_fd, port->rxBuf + port->rxStart + port->rxLen,
+                port->rxCapacity - port->rxStart - port->rxLen);
+  if (bytesRead < 0) {
+    packet_socket_closed(port);
+    return 0;
+  }
+  port->rxLen += bytesRead;
+  return bytesRead;
+}
+
+/* Receives the datagrams waiting on a UDP port into its stream buffer. Each
+ * datagram carries exactly one packet; any other datagram is dropped. Returns
+ * the number of bytes added, 0 if none. */
+static int packet_udp_read(struct Net_port *port) {
+  // Every datagram lands in a slot of its own at the end of the stream
+  // buffer, and the slots are then packed together
+  int slotSize = PACKET_HEADER_SIZE + PACKET_PAYLOAD_MAX;
+  packet_stream_reserve(port, SOCK_UDP_BATCH * slotSize);
+  char *slots = port->rxBuf + port->rxStart + port->rxLen;
+  int lens[SOCK_UDP_BATCH];
+  int count =
+      sock_udp_recv(port->recv_fd, slots, slotSize, lens, SOCK_UDP_BATCH);
+
+  int bytesAdded = 0;
+  for (int i = 0; i < count; i++) {
+    char *datagram = slots + i * slotSize;
+    if (lens[i] < PACKET_HEADER_SIZE ||
+        lens[i] != PACKET_HEADER_SIZE + packet_header_length(datagram)) {
+      fprintf(stderr, "\nError: packet_recv: dropping a malformed datagram\n");
+      continue;
+    }
+    memmove(slots + bytesAdded, datagram, lens[i]);
+    bytesAdded += lens[i];
+  }
+  port->rxLen += bytesAdded;
+  return bytesAdded;
+}
+
+/* Reads the next record of a LOCAL port's connection into its stream buffer,
+ * first accepting the remote node's connection if the port has none. A
+ * record holds whole packets, so the stream never has to wait for the rest of
+ * one; a record that does not is dropped. Returns the number of bytes added,
+ * 0 if none. */
+static int packet_local_read(struct Net_port *port) {
+  if (port->recv_fd < 0) {
+    int fd = sock_local_accept(port->listen_fd);
+    if (fd < 0) {
+      return 0;
+    }
+    packet_socket_adopt(port, fd);
+  }
+
+  packet_stream_reserve(port, PACKET_TX_BATCH_BYTES);
+  char *record = port->rxBuf + port->rxStart + port->rxLen;
+  int bytesRead = sock_local_recv(port->recv_fd, record,
+                                  port->rxCapacity - port->rxStart -
+                                      port->rxLen);
+  if (bytesRead < 0) {
+    packet_socket_closed(port);
+    return 0;
+  }
+
+  int offset = 0;
+  while (offset + PACKET_HEADER_SIZE <= bytesRead) {
+    offset += PACKET_HEADER_SIZE + packet_header_length(record + offset);
+  }
+  if (offset != bytesRead) {
+    fprintf(stderr, "\nError: packet_recv: dropping a malformed record\n");
+    return 0;
+  }
+  port->rxLen += bytesRead;
+  return bytesRead;
+}
+
+/*
+ * Output queue. packet_send() frames packets straight into the port's queue,
+ * and packet_flush() hands the queue to the link, keeping whatever the link
+ * cannot take without waiting. Stream links (pipes, shared memory rings and
+ * SOCKET connections) may take part of a packet; LOCAL links only take whole
+ * records and UDP links whole datagrams.
+ */
+
+/* Has the port's event loop wake the node once send_fd is writable (enable
+ * 1), or stops it (enable 0). */
+static void packet_watch_write(struct Net_port *port, int enable) {
+  if (port->loop == NULL || port->outWatchWrite == enable) {
+    return;
+  }
+  if (event_loop_watch_write(port->loop, port->send_fd, port->loopIndex,
+                             enable) == 0) {
+    port->outWatchWrite = enable;
+  }
+}
+
+/* Drops everything queued on port, counting it as lost with the link. */
+static void packet_queue_clear(struct Net_port *port) {
+  int numPackets = (port->outFrameLeft > 0) ? 1 : 0;
+  const char *frame = port->outBuf + port->outStart + port->outFrameLeft;
+  const char *end = port->outBuf + port->outStart + port->outLen;
+  while (frame < end) {
+    frame += PACKET_HEADER_SIZE + packet_header_length(frame);
+    numPackets++;
+  }
+  port->queueStats.linkDrops += numPackets;
+  port->outStart = 0;
+  port->outLen = 0;
+  port->outFrameLeft = 0;
+}
+
+/* Drops a SOCKET or LOCAL port's connection and its queue; the next connect
+ * is spaced out with an exponential backoff. */
+static void packet_socket_failed(struct Net_port *port, long long now) {
+  if (port->send_fd >= 0) {
+    // Closing the socket also removes it from the event loop
+    close(port->send_fd);
+  }
+  port->send_fd = -1;
+  port->sockConnecting = 0;
+  port->outWatchWrite = 0;
+  packet_queue_clear(port);
+  port->sockRetryMs = now + port->sockBackoffMs;
+  port->sockBackoffMs = (2 * port->sockBackoffMs > SOCKET_BACKOFF_MAX_MS)
+                            ? SOCKET_BACKOFF_MAX_MS
+                            : 2 * port->sockBackoffMs;
+}
+
+/* Makes sure a SOCKET or LOCAL port has a connection to send on, starting one
+ * if needed. Returns 1 once connected, 0 while a connect is in progress, or
+ * -1 if the remote node cannot be reached, in which case the queue has been
+ * dropped. */
+static int packet_socket_ready(struct Net_port *port) {
+  long long now = current_time_ms();
+  if (port->send_fd < 0) {
+    if (now < port->sockRetryMs) {
+      packet_queue_clear(port);
+      return -1;
+    }
+    if (port->type == LOCAL) {
+      // A local connect completes at once
+      port->send_fd = sock_local_connect(port->remoteDomain);
+    } else {
+      port->send_fd =
+          sock_connect(port->localDomain, port->remoteDomain, port->remotePort);
+      port->sockConnecting = 1;
+    }
+    if (port->send_fd < 0) {
+      packet_socket_failed(port, now);
+      return -1;
+    }
+    if (!port->sockConnecting) {
+      port->sockBackoffMs = SOCKET_BACKOFF_MIN_MS;
+    }
+  }
+
+  if (port->sockConnecting) {
+    int state = sock_connected(port->send_fd);
+    if (state < 0) {
+      packet_socket_failed(port, now);
+      return -1;
+    }
+    if (state == 0) {
+      packet_watch_write(port, 1);
+      return 0;
+    }
+    port->sockConnecting = 0;
+    port->sockBackoffMs = SOCKET_BACKOFF_MIN_MS;
+  }
+  return 1;
+}
+
+/* Drops the oldest packet on port's queue that has not started going out.
+ * Returns 0 on success, -1 if there is none. */
+static int packet_queue_drop_head(struct Net_port *port) {
+  // A write in flight only ever holds whole packets
+  int started = port->outFrameLeft + port->outInFlight;
+  char *frame = port->outBuf + port->outStart + started;
+  int behind = port->outLen - started;
+  if (behind == 0) {
+    return -1;
+  }
+  int frameLen = PACKET_HEADER_SIZE + packet_header_length(frame);
+  memmove(frame, frame + frameLen, behind - frameLen);
+  port->outLen -= frameLen;
+  port->queueStats.headDrops++;
+  return 0;
+}
+
+/* Makes room for a len byte packet at the end of port's queue, as far as the
+ * port's queue policy allows. Returns where to put the packet, or NULL if it
+ * is dropped. */
+static char *packet_queue_reserve(struct Net_port *port, int len) {
+  if (port->outBuf == NULL) {
+    port->outBuf = (char *)malloc(PORT_QUEUE_BYTES);
+  }
+
+  if (port->queuePolicy == QUEUE_RED) {
+    // Moving average over roughly the last eight packets
+    port->redAvgDepth += (port->outLen - port->redAvgDepth) / 8;
+    if (port->redAvgDepth >= RED_MAX_BYTES ||
+        (port->redAvgDepth > RED_MIN_BYTES &&
+         (int)(rand_r(&port->redSeed) %
+               ((RED_MAX_BYTES - RED_MIN_BYTES) * RED_MAX_P_INV)) <
+             port->redAvgDepth - RED_MIN_BYTES)) {
+      port->queueStats.earlyDrops++;
+      return NULL;
+    }
+  }
+
+  while (port->outLen + len > PORT_QUEUE_BYTES) {
+    if (port->queuePolicy != QUEUE_HEAD_DROP ||
+        packet_queue_drop_head(port) < 0) {
+      port->queueStats.tailDrops++;
+      return NULL;
+    }
+  }
 
+  if (port->outStart + port->outLen + len > PORT_QUEUE_BYTES) {
+    memmove(port->outBuf, port->outBuf + port->outStart, port->outLen);
+    port->outStart = 0;
+  }
+  char *frame = port->outBuf + port->outStart + port->outLen;
+  port->outLen += len;
+  port->queueStats.enqueued++;
+  if (port->outLen > port->queueStats.maxDepth) {
+    port->queueStats.maxDepth = port->outLen;
+  }
+  return frame;
+}
+
+/* Removes the first n bytes of port's queue, which the link has taken. */
+static void packet_queue_advance(struct Net_port *port, int n) {
+  port->outStart += n;
+  port->outLen -= n;
+  if (port->outLen == 0) {
+    port->outStart = 0;
+    port->outFrameLeft = 0;
+    return;
+  }
+  if (n <= port->outFrameLeft) {
+    port->outFrameLeft -= n;
+    return;
+  }
+
+  // Walk the packets taken to find how much of the last one is left
+  int done = n - port->outFrameLeft;
+  const char *frame = port->outBuf + port->outStart - done;
+  while (done > 0) {
+    int frameLen = PACKET_HEADER_SIZE + packet_header_length(frame);
+    if (done < frameLen) {
+      port->outFrameLeft = frameLen - done;
+      return;
+    }
+    done -= frameLen;
+    frame += frameLen;
+  }
+  port->outFrameLeft = 0;
+}
+
+/* Sends len bytes of whole packets on a LOCAL port's connection, as records
+ * of up to PACKET_TX_BATCH_BYTES. Returns the number of bytes sent, or -1 if
+ * the connection failed. */
+static int packet_local_send(struct Net_port *port, const char *buf, int len) {
+  int sent = 0;
+  while (sent < len) {
+    int recordLen = 0;
+    while (sent + recordLen < len) {
+      int frameLen = PACKET_HEADER_SIZE +
+                     packet_header_length(buf + sent + recordLen);
+      if (recordLen > 0 && recordLen + frameLen > PACKET_TX_BATCH_BYTES) {
+        break;
+      }
+      recordLen += frameLen;
+    }
+    int state = sock_local_send(port->send_fd, buf + sent, recordLen);
+    if (state < 0) {
+      return -1;
+    }
+    if (state == 0) {
+      break;
+    }
+    sent += recordLen;
+  }
+  return sent;
+}
+
+/* Sends the packets queued on a UDP port, one datagram each. Datagrams the
+ * socket has no room for are dropped rather than kept, as a network would. */
+static void packet_udp_write(struct Net_port *port) {
+  char *buf = port->outBuf + port->outStart;
+  int offset = 0;
+  while (offset < port->outLen) {
+    int lens[SOCK_UDP_BATCH];
+    int count = 0;
+    int len = 0;
+    while (offset + len < port->outLen && count < SOCK_UDP_BATCH) {
+      lens[count] =
+          PACKET_HEADER_SIZE + packet_header_length(buf + offset + len);
+      len += lens[count++];
+    }
+    int sent = sock_udp_send(port->send_fd, buf + offset, lens, count);
+    if (sent < count) {
+      port->queueStats.tailDrops += count - (sent > 0 ? sent : 0);
+    }
+    offset += len;
+  }
+  port->outStart = 0;
+  port->outLen = 0;
+}
+
+/* Hands as much of port's queue to its link as it takes without waiting.
+ * Pipe, SOCKET and LOCAL ports then have the event loop report when the link
+ * takes more; a shared memory ring signals its space eventfd instead. */
+static void packet_queue_write(struct Net_port *port) {
+  char *buf = port->outBuf + port->outStart;
+  int n;
+  switch (port->type) {
+    case UDP:
+      packet_udp_write(port);
+      return;
+    case SHM:
+      // Also called with an empty queue to clear the space eventfd
+      n = shm_ring_write(port->shmTx, buf, port->outLen);
+      packet_queue_advance(port, n);
+      return;
+    case SOCKET:
+    case LOCAL:
+      if (packet_socket_ready(port) <= 0) {
+        return;
+      }
+      n = (port->type == LOCAL) ? packet_local_send(port, buf, port->outLen)
+                                : sock_send(port->send_fd, buf, port->outLen);
+      if (n < 0) {
+        packet_socket_failed(port, current_time_ms());
+        return;
+      }
+      break;
+    default:
+      n = write(port->send_fd, buf, port->outLen);
+      if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          packet_queue_clear(port);
+        }
+        n = 0;
+      }
+  }
+  packet_queue_advance(port, n);
+  packet_watch_write(port, port->outLen > 0);
+}
+
+int packet_recv(struct Net_port *port, struct Packet *p) {
   if (port->type == PIPE) {
-    // Parse Packet
-    bytesRead = read(port->recv_fd, pkt, PACKET_PAYLOAD_MAX + 4);
-  } else if (port->type == SOCKET) {
-    bytesRead = sock_recv(port->send_fd, pkt, PACKET_PAYLOAD_MAX + 4,
-                          port->remoteDomain);
+    int frameLen = packet_stream_take(port, p);
+    if (frameLen == 0 && port->ring == NULL) {
+      // Pull in everything the pipe holds; an io_uring port is filled by
+      // the node's ring instead
+      packet_stream_reserve(port, PACKET_HEADER_SIZE + PACKET_PAYLOAD_MAX);
+      int bytesRead =
+          read(port->recv_fd, port->rxBuf + port->rxStart + port->rxLen,
+               port->rxCapacity - port->rxStart - port->rxLen);
+      if (bytesRead <= 0) {
+        return bytesRead;
+      }
+      port->rxLen += bytesRead;
+      frameLen = packet_stream_take(port, p);
+    }
+    return frameLen;
   }
-  if (bytesRead > 0) {
-    p->src = (char)pkt[0];
-    p->dst = (char)pkt[1];
-    p->type = (char)pkt[2];
-    p->length = (int)pkt[3];
-    for (int i = 0; i < p->length; i++) {
-      p->payload[i] = pkt[i + 4];
+
+  if (port->type == SHM) {
+    // Copy straight from the shared ring into the stream buffer
+    int frameLen = packet_stream_take(port, p);
+    if (frameLen == 0) {
+      packet_stream_reserve(port, PACKET_TX_BATCH_BYTES);
+      int bytesRead =
+          shm_ring_read(port->shmRx, port->rxBuf + port->rxStart + port->rxLen,
+                        port->rxCapacity - port->rxStart - port->rxLen);
+      port->rxLen += bytesRead;
+      if (bytesRead > 0) {
+        frameLen = packet_stream_take(port, p);
+      }
+    }
+    return frameLen;
+  }
+
+  // A socket link is a byte stream over a long-lived connection, and UDP and
+  // LOCAL links a series of records holding whole packets; any of them is
+  // read only once no whole packet is left in the stream buffer
+  int frameLen = packet_stream_take(port, p);
+  if (frameLen == 0) {
+    int bytesRead;
+    if (port->type == UDP) {
+      bytesRead = packet_udp_read(port);
+    } else if (port->type == LOCAL) {
+      bytesRead = packet_local_read(port);
+    } else {
+      bytesRead = packet_socket_read(port);
     }
+    if (bytesRead > 0) {
+      frameLen = packet_stream_take(port, p);
+    }
+  }
+  return frameLen;
+}
+
+int packet_pending(struct Net_port *port) {
+  if (port->rxBuf == NULL || port->rxLen < PACKET_HEADER_SIZE) {
+    return 0;
+  }
+  return port->rxLen >= PACKET_HEADER_SIZE +
+                            packet_header_length(port->rxBuf + port->rxStart);
+}
+
+/* Hands port's queue to its link. With io_uring, a pipe port's queue is
+ * submitted to the ring as one write when it fits in a ring slot; it stays
+ * queued until packet_write_done() hears how much was written, and nothing
+ * behind it goes out before then. A pipe the ring found full is written
+ * directly until the event loop has seen it drain. */
+static void packet_flush_port(struct Net_port *port) {
+  port->txLen = 0;
+  port->txCount = 0;
+  if ((port->outLen == 0 && port->type != SHM) || port->outInFlight > 0) {
+    return;
+  }
+  if (port->ring != NULL && !port->outWatchWrite && port->outFrameLeft == 0 &&
+      port->outLen <= URING_TX_SLOT_SIZE &&
+      uring_queue_write(port->ring, port, port->outBuf + port->outStart,
+                        port->outLen) == 0) {
+    port->outInFlight = port->outLen;
+    return;
+  }
+  packet_queue_write(port);
+}
+
+void packet_write_done(struct Net_port *port, int res) {
+  int inFlight = port->outInFlight;
+  port->outInFlight = 0;
+  if (res == -EAGAIN || res == -EINTR) {
+    res = 0;
+  } else if (res < 0) {
+    // The same loss a failed write() makes
+    packet_queue_clear(port);
+    return;
+  }
+  packet_queue_advance(port, res);
+  if (res < inFlight) {
+    // The pipe is full; the next flush after it has room writes the rest
+    packet_watch_write(port, 1);
+  }
+}
+
+void packet_flush(struct Net_port **ports, int numPorts) {
+  for (int i = 0; i < numPorts; i++) {
+    packet_flush_port(ports[i]);
   }
-  return (bytesRead);
 }
 
-/* Sends a network packet through a pipe or socket by parsing the packet into a
- * message buffer and then sending it. */
 void packet_send(struct Net_port *port, struct Packet *p) {
-  char pkt[PACKET_PAYLOAD_MAX + 4];
-  int bytesSent = -1;
+  if (p->length > port->mtu) {
+    port->queueStats.mtuDrops++;
+    return;
+  }
 
-  // Parse Packet
-  pkt[0] = (char)p->src;
-  pkt[1] = (char)p->dst;
-  pkt[2] = (char)p->type;
-  pkt[3] = (char)p->length;
-  for (int i = 0; i < p->length; i++) {
-    pkt[i + 4] = p->payload[i];
+  int frameLen = PACKET_HEADER_SIZE + p->length;
+  if (port->txLen + frameLen > PACKET_TX_BATCH_BYTES) {
+    packet_flush_port(port);
+  }
+  char *pkt = packet_queue_reserve(port, frameLen);
+  if (pkt == NULL) {
+    return;
+  }
+  if (port->txCount == 0) {
+    port->txFirstMs = current_time_ms();
   }
 
-  if (port->type == PIPE) {
-    bytesSent = write(port->send_fd, pkt, p->length + 4);
-  } else if (port->type == SOCKET) {
-    bytesSent = sock_send(port->localDomain, port->remoteDomain,
-                          port->remotePort, pkt, p->length + 4);
+  // Frame the packet at the end of the queue
+  packet_put32(pkt, p->src);
+  packet_put32(pkt + 4, p->dst);
+  pkt[8] = (char)p->type;
+  pkt[9] = (char)p->hops;
+  pkt[10] = (char)(p->length >> 8);
+  pkt[11] = (char)p->length;
+  memcpy(pkt + PACKET_HEADER_SIZE, p->payload, p->length);
+  port->txLen += frameLen;
+  port->txCount++;
+
+  if (port->txCount >= PACKET_TX_BATCH_MAX ||
+      current_time_ms() - port->txFirstMs >= PACKET_TX_FLUSH_MS) {
+    packet_flush_port(port);
   }
 }
 
@@ -73,8 +664,9 @@ struct Packet *createPacket(int src, int dst, int type, int length,
   p->dst = dst;
   p->type = type;
   if (payload != NULL) {
-    strncpy(p->payload, payload, PACKET_PAYLOAD_MAX);
-    p->length = strlen(payload);
+    p->length = strnlen(payload, PACKET_PAYLOAD_MAX);
+    memcpy(p->payload, payload, p->length);
+    p->payload[p->length] = '\0';
   }
   return p;
 }
@@ -85,8 +677,50 @@ struct Packet *createEmptyPacket() {
   memset(&p->dst, 0, sizeof(p->dst));
   memset(&p->src, 0, sizeof(p->src));
   memset(&p->type, 0, sizeof(p->type));
+  memset(&p->hops, 0, sizeof(p->hops));
   memset(&p->length, 0, sizeof(p->length));
-  memset(&p->payload, 0, sizeof(p->payload));
+  // Only the used part of a payload is ever copied, so clearing its first
+  // byte is enough to make it an empty string
+  p->payload[0] = '\0';
+  p->pool = NULL;
+  p->nextFree = NULL;
+  return p;
+}
+
+void packet_pool_init(struct PacketPool *pool) {
+  pool->freeList = NULL;
+  pool->numFree = 0;
+  pool->numInUse = 0;
+}
+
+struct Packet *packet_pool_get(struct PacketPool *pool) {
+  if (pool->freeList == NULL) {
+    // Slabs stay with the node for its lifetime
+    struct Packet *slab =
+        (struct Packet *)malloc(PACKET_POOL_SLAB * sizeof(struct Packet));
+    if (slab == NULL) {
+      fprintf(stderr, "Failed to allocate memory for packet pool\n");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < PACKET_POOL_SLAB; i++) {
+      slab[i].pool = pool;
+      slab[i].nextFree = pool->freeList;
+      pool->freeList = &slab[i];
+    }
+    pool->numFree += PACKET_POOL_SLAB;
+  }
+
+  struct Packet *p = pool->freeList;
+  pool->freeList = p->nextFree;
+  pool->numFree--;
+  pool->numInUse++;
+  p->nextFree = NULL;
+  p->src = 0;
+  p->dst = 0;
+  p->type = 0;
+  p->hops = 0;
+  p->length = 0;
+  p->payload[0] = '\0';
   return p;
 }
 
@@ -95,14 +729,22 @@ struct Packet *deepcopy_packet(const struct Packet *original) {
   copy->src = original->src;
   copy->dst = original->dst;
   copy->type = original->type;
+  copy->hops = original->hops;
   copy->length = original->length;
-  memcpy(copy->payload, original->payload, PACKET_PAYLOAD_MAX);
+  memcpy(copy->payload, original->payload, original->length);
+  copy->payload[copy->length] = '\0';
   return copy;
 }
 
 void packet_delete(struct Packet *p) {
   if (p == NULL) {
     fprintf(stderr, "packet_delete called on NULL packet\n");
+  } else if (p->pool != NULL) {
+    struct PacketPool *pool = p->pool;
+    p->nextFree = pool->freeList;
+    pool->freeList = p;
+    pool->numFree++;
+    pool->numInUse--;
   } else {
     free(p);
     p = NULL;
@@ -142,6 +784,8 @@ char *get_packet_type_literal(int pktType) {
       return "PKT_DNS_REGISTRATION";
     case PKT_DNS_REGISTRATION_RESPONSE:
       return "PKT_DNS_REGISTRATION_RESPONSE";
+    case PKT_ROUTE:
+      return "PKT_ROUTE";
     default:
       return "UNKNOWN_PACKET_TYPE";
   }
@@ -0,0 +1,188 @@
+/*
+    route.c
+*/
+
+#include "route.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Routes a table starts out with room for (a power of two)
+#define ROUTE_INITIAL_CAPACITY 16
+
+static int route_home(const struct RouteTable *table, int dst) {
+  // Fibonacci hashing spreads sequential ids over the slots
+  return ((unsigned int)dst * 2654435769u) & (2 * table->capacity - 1);
+}  // End of route_home()
+
+static uint8_t *route_via(const struct RouteTable *table, int r) {
+  return table->viaDist + (size_t)r * table->numPorts;
+}  // End of route_via()
+
+/* Returns the slot holding dst, or the free slot where it belongs. */
+static int route_probe(const struct RouteTable *table, int dst) {
+  int mask = 2 * table->capacity - 1;
+  int i = route_home(table, dst);
+  while (table->slots[i] >= 0 && table->dst[table->slots[i]] != dst) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}  // End of route_probe()
+
+/* Doubles the room for routes and rehashes them, keeping the slots at most
+ * half full. */
+static void route_grow(struct RouteTable *table) {
+  table->capacity *= 2;
+  table->dst = (int *)realloc(table->dst, table->capacity * sizeof(int));
+  table->dist = (uint8_t *)realloc(table->dist, table->capacity);
+  table->viaDist = (uint8_t *)realloc(
+      table->viaDist, (size_t)table->capacity * table->numPorts);
+  free(table->slots);
+  table->slots = (int *)malloc(2 * table->capacity * sizeof(int));
+  memset(table->slots, -1, 2 * table->capacity * sizeof(int));
+  for (int r = 0; r < table->numRoutes; r++) {
+    table->slots[route_probe(table, table->dst[r])] = r;
+  }
+}  // End of route_grow()
+
+/* Returns the route to dst, adding it (unreachable through every port) if
+ * there is none yet. */
+static int route_add(struct RouteTable *table, int dst) {
+  int slot = route_probe(table, dst);
+  if (table->slots[slot] >= 0) {
+    return table->slots[slot];
+  }
+  if (table->numRoutes == table->capacity) {
+    route_grow(table);
+    slot = route_probe(table, dst);
+  }
+  int r = table->numRoutes++;
+  table->dst[r] = dst;
+  table->dist[r] = ROUTE_UNREACHABLE;
+  memset(route_via(table, r), ROUTE_UNREACHABLE, table->numPorts);
+  table->slots[slot] = r;
+  return r;
+}  // End of route_add()
+
+/* Returns the distance to route r's node through port, ROUTE_UNREACHABLE if
+ * it is not reached that way. */
+static int route_port_cost(const struct RouteTable *table, int r, int port) {
+  if (table->portNode[port] == table->dst[r]) {
+    return 1;
+  }
+  int via = route_via(table, r)[port];
+  if (!table->portUp[port] || via >= ROUTE_MAX_DIST) {
+    return ROUTE_UNREACHABLE;
+  }
+  return via + 1;
+}  // End of route_port_cost()
+
+void route_table_init(struct RouteTable *table, int numPorts) {
+  table->numPorts = numPorts;
+  table->portNode = (int *)malloc(numPorts * sizeof(int));
+  table->portUp = (uint8_t *)calloc(numPorts, 1);
+  for (int p = 0; p < numPorts; p++) {
+    table->portNode[p] = -1;
+  }
+  table->numRoutes = 0;
+  table->capacity = ROUTE_INITIAL_CAPACITY;
+  table->dst = (int *)malloc(table->capacity * sizeof(int));
+  table->dist = (uint8_t *)malloc(table->capacity);
+  table->viaDist = (uint8_t *)malloc((size_t)table->capacity * numPorts);
+  table->slots = (int *)malloc(2 * table->capacity * sizeof(int));
+  memset(table->slots, -1, 2 * table->capacity * sizeof(int));
+}  // End of route_table_init()
+
+void route_set_port(struct RouteTable *table, int port, int isSwitch,
+                    int endpointId, int up) {
+  if (!up) {
+    // Nothing the lost neighbor said holds any more
+    for (int r = 0; r < table->numRoutes; r++) {
+      route_via(table, r)[port] = ROUTE_UNREACHABLE;
+    }
+    table->portNode[port] = -1;
+    table->portUp[port] = 0;
+    return;
+  }
+  table->portUp[port] = isSwitch;
+  table->portNode[port] = isSwitch ? -1 : endpointId;
+  if (!isSwitch && endpointId >= 0) {
+    route_add(table, endpointId);
+  }
+}  // End of route_set_port()
+
+void route_receive(struct RouteTable *table, int port, const char *payload,
+                   int length) {
+  const unsigned char *entry = (const unsigned char *)payload;
+  for (int i = 0; i + ROUTE_ENTRY_SIZE <= length; i += ROUTE_ENTRY_SIZE) {
+    int dst = (int)((uint32_t)entry[i] << 24 | (uint32_t)entry[i + 1] << 16 |
+                    (uint32_t)entry[i + 2] << 8 | entry[i + 3]);
+    int r = route_add(table, dst);
+    route_via(table, r)[port] = entry[i + 4];
+  }
+}  // End of route_receive()
+
+int route_recompute(struct RouteTable *table) {
+  int changed = 0;
+  for (int r = 0; r < table->numRoutes; r++) {
+    int best = ROUTE_UNREACHABLE;
+    for (int p = 0; p < table->numPorts; p++) {
+      int cost = route_port_cost(table, r, p);
+      if (cost < best) {
+        best = cost;
+      }
+    }
+    if (best >= ROUTE_MAX_DIST) {
+      best = ROUTE_UNREACHABLE;
+    }
+    if (table->dist[r] != best) {
+      table->dist[r] = best;
+      changed = 1;
+    }
+  }
+  return changed;
+}  // End of route_recompute()
+
+int route_encode(const struct RouteTable *table, int port, int *next,
+                 char *buf, int max) {
+  int len = 0;
+  while (*next < table->numRoutes && len + ROUTE_ENTRY_SIZE <= max) {
+    int r = (*next)++;
+    int dist = table->dist[r];
+    if (dist != ROUTE_UNREACHABLE && route_port_cost(table, r, port) == dist) {
+      // The neighbor is on our shortest path, so it must not route via us
+      dist = ROUTE_UNREACHABLE;
+    }
+    uint32_t dst = (uint32_t)table->dst[r];
+    buf[len] = (char)(dst >> 24);
+    buf[len + 1] = (char)(dst >> 16);
+    buf[len + 2] = (char)(dst >> 8);
+    buf[len + 3] = (char)dst;
+    buf[len + 4] = (char)dist;
+    len += ROUTE_ENTRY_SIZE;
+  }
+  return len;
+}  // End of route_encode()
+
+int route_next_hop(const struct RouteTable *table, int dst,
+                   unsigned int flowHash) {
+  int slot = route_probe(table, dst);
+  int r = table->slots[slot];
+  if (r < 0 || table->dist[r] == ROUTE_UNREACHABLE) {
+    return -1;
+  }
+
+  int numEqual = 0;
+  for (int p = 0; p < table->numPorts; p++) {
+    numEqual += route_port_cost(table, r, p) == table->dist[r];
+  }
+  // Scale by the high bits of the hash, which are better mixed than its low
+  // ones
+  int pick = (int)(((uint64_t)flowHash * numEqual) >> 32);
+  for (int p = 0; p < table->numPorts; p++) {
+    if (route_port_cost(table, r, p) == table->dist[r] && pick-- == 0) {
+      return p;
+    }
+  }
+  return -1;
+}  // End of route_next_hop()
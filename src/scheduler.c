@@ -0,0 +1,351 @@
+/*
+    scheduler.c
+*/
+
+#include "scheduler.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "eventLoop.h"
+
+/*
+ * Work-stealing runtime. Every task has a home worker whose epoll instance
+ * watches the task's event loop, registered one-shot so a task is never
+ * handed out twice. When a task becomes ready its home worker moves it onto
+ * its own deque; a worker that runs dry steals from the other end of another
+ * worker's deque. Tasks without events sit in epoll only and cost nothing.
+ *
+ * A worker runs tasks from the bottom of its deque. A task that still has
+ * work after its step is put back at the top, behind everything else, which
+ * is also where thieves take from, so a hot node is the first to migrate to
+ * an idle core.
+ */
+struct Worker {
+  int index;
+  int epfd;    // Watches the event loops of the tasks homed here
+  int kickfd;  // Written by other workers when there is work to steal
+  int idle;    // Set while blocked in epoll_wait
+  pthread_mutex_t lock;
+  struct NodeTask **deque;  // Ring buffer of ready tasks
+  int head;
+  int count;
+  int capacity;
+  struct Scheduler *sched;
+};
+
+struct Scheduler {
+  struct Worker *workers;
+  int numWorkers;
+};
+
+// Registers (EPOLL_CTL_ADD) or re-arms (EPOLL_CTL_MOD) a task's event loop in
+// its home worker's epoll. Without EPOLLIN the registration stays disarmed.
+static void scheduler_watch_task(struct Worker *home, struct NodeTask *task,
+                                 int op, uint32_t events) {
+  struct epoll_event ev;
+  ev.events = events | EPOLLONESHOT;
+  ev.data.ptr = task;
+  if (epoll_ctl(home->epfd, op, task->loop->epfd, &ev) < 0) {
+    fprintf(stderr, "\nError: scheduler: failed to watch node %d\n", task->id);
+    perror("\t");
+  }
+}  // End of scheduler_watch_task()
+
+static void deque_push_bottom(struct Worker *w, struct NodeTask *task) {
+  pthread_mutex_lock(&w->lock);
+  w->deque[(w->head + w->count) % w->capacity] = task;
+  w->count++;
+  pthread_mutex_unlock(&w->lock);
+}  // End of deque_push_bottom()
+
+static void deque_push_top(struct Worker *w, struct NodeTask *task) {
+  pthread_mutex_lock(&w->lock);
+  w->head = (w->head + w->capacity - 1) % w->capacity;
+  w->deque[w->head] = task;
+  w->count++;
+  pthread_mutex_unlock(&w->lock);
+}  // End of deque_push_top()
+
+static struct NodeTask *deque_pop_bottom(struct Worker *w) {
+  struct NodeTask *task = NULL;
+  pthread_mutex_lock(&w->lock);
+  if (w->count > 0) {
+    w->count--;
+    task = w->deque[(w->head + w->count) % w->capacity];
+  }
+  pthread_mutex_unlock(&w->lock);
+  return task;
+}  // End of deque_pop_bottom()
+
+static struct NodeTask *deque_steal_top(struct Worker *w) {
+  struct NodeTask *task = NULL;
+  pthread_mutex_lock(&w->lock);
+  if (w->count > 0) {
+    task = w->deque[w->head];
+    w->head = (w->head + 1) % w->capacity;
+    w->count--;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return task;
+}  // End of deque_steal_top()
+
+// Wakes one idle worker so it can steal from w, if w has work to spare
+static void scheduler_kick_idle(struct Worker *w) {
+  struct Scheduler *sched = w->sched;
+  if (__atomic_load_n(&w->count, __ATOMIC_RELAXED) < 2) {
+    return;
+  }
+  for (int i = 1; i < sched->numWorkers; i++) {
+    struct Worker *other = &sched->workers[(w->index + i) % sched->numWorkers];
+    if (__atomic_exchange_n(&other->idle, 0, __ATOMIC_ACQ_REL)) {
+      uint64_t one = 1;
+      write(other->kickfd, &one, sizeof(one));
+      return;
+    }
+  }
+}  // End of scheduler_kick_idle()
+
+// Moves the tasks reported ready by w's epoll onto its deque. Blocks for at
+// most timeoutMs.
+static void scheduler_harvest(struct Worker *w, int timeoutMs) {
+  struct epoll_event ready[EVENT_LOOP_MAX_EVENTS];
+  int n = epoll_wait(w->epfd, ready, EVENT_LOOP_MAX_EVENTS, timeoutMs);
+  for (int i = 0; i < n; i++) {
+    struct NodeTask *task = (struct NodeTask *)ready[i].data.ptr;
+    if (task == NULL) {
+      uint64_t kicks;
+      read(w->kickfd, &kicks, sizeof(kicks));
+    } else {
+      deque_push_bottom(w, task);
+    }
+  }
+  if (n > 0) {
+    scheduler_kick_idle(w);
+  }
+}  // End of scheduler_harvest()
+
+static struct NodeTask *scheduler_steal(struct Worker *w) {
+  struct Scheduler *sched = w->sched;
+  for (int i = 1; i < sched->numWorkers; i++) {
+    struct Worker *victim = &sched->workers[(w->index + i) % sched->numWorkers];
+    struct NodeTask *task = deque_steal_top(victim);
+    if (task != NULL) {
+      return task;
+    }
+  }
+  return NULL;
+}  // End of scheduler_steal()
+
+static void *scheduler_worker(void *arg) {
+  struct Worker *w = (struct Worker *)arg;
+  struct Scheduler *sched = w->sched;
+
+  while (1) {
+    // Pick up tasks homed here that became ready while we were busy
+    scheduler_harvest(w, 0);
+
+    struct NodeTask *task = deque_pop_bottom(w);
+    if (task == NULL) {
+      task = scheduler_steal(w);
+    }
+    if (task == NULL) {
+      // Nothing to run anywhere: sleep until one of our tasks has events or
+      // a busy worker kicks us
+      __atomic_store_n(&w->idle, 1, __ATOMIC_RELEASE);
+      scheduler_harvest(w, -1);
+      __atomic_store_n(&w->idle, 0, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    if (task->step(task->context, 0)) {
+      deque_push_top(w, task);
+      scheduler_kick_idle(w);
+    } else {
+      scheduler_watch_task(&sched->workers[task->homeWorker], task,
+                           EPOLL_CTL_MOD, EPOLLIN);
+    }
+  }
+  return NULL;
+}  // End of scheduler_worker()
+
+int scheduler_start(struct NodeTask *tasks, int numThreads) {
+  struct Scheduler *sched = (struct Scheduler *)malloc(sizeof(struct Scheduler));
+  sched->numWorkers = numThreads;
+  sched->workers = (struct Worker *)malloc(numThreads * sizeof(struct Worker));
+
+  int numTasks = 0;
+  for (struct NodeTask *task = tasks; task != NULL; task = task->next) {
+    numTasks++;
+  }
+
+  for (int i = 0; i < numThreads; i++) {
+    struct Worker *w = &sched->workers[i];
+    w->index = i;
+    w->idle = 0;
+    w->sched = sched;
+    pthread_mutex_init(&w->lock, NULL);
+    // A task is on at most one deque at a time, so no deque outgrows this
+    w->capacity = numTasks + 1;
+    w->deque = (struct NodeTask **)malloc(w->capacity * sizeof(struct NodeTask *));
+    w->head = 0;
+    w->count = 0;
+
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    w->kickfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->epfd < 0 || w->kickfd < 0) {
+      fprintf(stderr, "\nError: scheduler_start: failed to create event fds\n");
+      perror("\t");
+      return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->kickfd, &ev);
+  }
+
+  // Spread the tasks over the workers; each starts on its home deque so it
+  // gets an initial step
+  int next = 0;
+  for (struct NodeTask *task = tasks; task != NULL; task = task->next) {
+    struct Worker *home = &sched->workers[next];
+    task->homeWorker = next;
+    scheduler_watch_task(home, task, EPOLL_CTL_ADD, 0);
+    deque_push_bottom(home, task);
+    next = (next + 1) % numThreads;
+  }
+
+  for (int i = 0; i < numThreads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, scheduler_worker, &sched->workers[i]) !=
+        0) {
+      fprintf(stderr, "\nError: scheduler_start: failed to start worker %d\n",
+              i);
+      return -1;
+    }
+    pthread_detach(thread);
+  }
+  return 0;
+}  // End of scheduler_start()
+
+/*
+ * Virtual-time runtime. A single thread plays every node in rounds: each round
+ * steps the nodes that have fd events, a due timer or leftover work, in
+ * ascending node id so that ties are always broken the same way. Packets sent
+ * during a round are picked up in the next one. Only when a round finds
+ * nothing to do does the clock move, directly to the earliest timer; with no
+ * timer armed the thread blocks until the manager sends a command.
+ */
+struct VirtualScheduler {
+  int epfd;  // Watches the event loops of all tasks
+  int numTasks;
+  struct NodeTask **round;  // Tasks to step in the current round
+  int roundSize;
+};
+
+static void virtual_mark_ready(struct VirtualScheduler *vs,
+                               struct NodeTask *task) {
+  if (!task->ready) {
+    task->ready = 1;
+    vs->round[vs->roundSize++] = task;
+  }
+}  // End of virtual_mark_ready()
+
+static void virtual_harvest(struct VirtualScheduler *vs, int timeoutMs) {
+  struct epoll_event ready[EVENT_LOOP_MAX_EVENTS];
+  int n = epoll_wait(vs->epfd, ready, EVENT_LOOP_MAX_EVENTS, timeoutMs);
+  for (int i = 0; i < n; i++) {
+    virtual_mark_ready(vs, (struct NodeTask *)ready[i].data.ptr);
+  }
+}  // End of virtual_harvest()
+
+static int virtual_by_id(const void *a, const void *b) {
+  return (*(struct NodeTask *const *)a)->id -
+         (*(struct NodeTask *const *)b)->id;
+}  // End of virtual_by_id()
+
+static void *scheduler_virtual_worker(void *arg) {
+  struct VirtualScheduler *vs = (struct VirtualScheduler *)arg;
+  struct NodeTask **current = (struct NodeTask **)malloc(
+      vs->numTasks * sizeof(struct NodeTask *));
+  struct EventLoop **due = (struct EventLoop **)malloc(
+      vs->numTasks * sizeof(struct EventLoop *));
+
+  while (1) {
+    virtual_harvest(vs, 0);
+    if (vs->roundSize == 0) {
+      int numDue = event_loop_advance_virtual_time(due, vs->numTasks);
+      for (int i = 0; i < numDue; i++) {
+        virtual_mark_ready(vs, (struct NodeTask *)due[i]->owner);
+      }
+      if (numDue == 0) {
+        // Nothing is scheduled; wait for the manager in real time
+        virtual_harvest(vs, -1);
+      }
+      continue;
+    }
+
+    int numCurrent = vs->roundSize;
+    memcpy(current, vs->round, numCurrent * sizeof(struct NodeTask *));
+    vs->roundSize = 0;
+    qsort(current, numCurrent, sizeof(struct NodeTask *), virtual_by_id);
+    for (int i = 0; i < numCurrent; i++) {
+      current[i]->ready = 0;
+    }
+    for (int i = 0; i < numCurrent; i++) {
+      if (current[i]->step(current[i]->context, 0)) {
+        virtual_mark_ready(vs, current[i]);
+      }
+    }
+  }
+  return NULL;
+}  // End of scheduler_virtual_worker()
+
+int scheduler_start_virtual(struct NodeTask *tasks) {
+  struct VirtualScheduler *vs =
+      (struct VirtualScheduler *)malloc(sizeof(struct VirtualScheduler));
+  vs->numTasks = 0;
+  for (struct NodeTask *task = tasks; task != NULL; task = task->next) {
+    vs->numTasks++;
+  }
+  vs->round = (struct NodeTask **)malloc(vs->numTasks *
+                                         sizeof(struct NodeTask *));
+  vs->roundSize = 0;
+
+  vs->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (vs->epfd < 0) {
+    fprintf(stderr, "\nError: scheduler_start_virtual: epoll_create1 failed\n");
+    perror("\t");
+    return -1;
+  }
+
+  // Every task gets an initial step in the first round
+  for (struct NodeTask *task = tasks; task != NULL; task = task->next) {
+    task->ready = 0;
+    task->loop->owner = task;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = task;
+    if (epoll_ctl(vs->epfd, EPOLL_CTL_ADD, task->loop->epfd, &ev) < 0) {
+      fprintf(stderr, "\nError: scheduler: failed to watch node %d\n",
+              task->id);
+      perror("\t");
+      return -1;
+    }
+    virtual_mark_ready(vs, task);
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, scheduler_virtual_worker, vs) != 0) {
+    fprintf(stderr, "\nError: scheduler_start_virtual: failed to start\n");
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}  // End of scheduler_start_virtual()
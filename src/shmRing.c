@@ -0,0 +1,163 @@
+/*
+    shmRing.c
+*/
+
+#include "shmRing.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * head and tail count every byte ever read and written, so they only need
+ * masking when used as offsets; tail - head is the number of bytes waiting.
+ * The producer owns tail and the consumer head, each on a cache line of its
+ * own. waiting is 1 while the consumer is armed: it found the ring empty and
+ * has not been woken since. Whoever clears it writes the eventfd, so the
+ * eventfd is only touched once per empty-to-nonempty transition. The
+ * producer waits for room the same way through writerWaiting and spaceFd;
+ * writerArmed, which only the producer touches, remembers that spaceFd may
+ * need clearing.
+ */
+struct ShmRing {
+  unsigned int head __attribute__((aligned(64)));
+  unsigned int tail __attribute__((aligned(64)));
+  int writerArmed;
+  int waiting __attribute__((aligned(64)));
+  int writerWaiting;
+  int efd;
+  int spaceFd;
+  char data[SHM_RING_BYTES] __attribute__((aligned(64)));
+};
+
+struct ShmRing *shm_ring_create() {
+  struct ShmRing *ring =
+      (struct ShmRing *)mmap(NULL, sizeof(struct ShmRing),
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    fprintf(stderr, "\nError: shm_ring_create: mmap failed\n");
+    perror("\t");
+    return NULL;
+  }
+
+  ring->efd = eventfd(0, EFD_NONBLOCK);
+  ring->spaceFd = eventfd(0, EFD_NONBLOCK);
+  if (ring->efd < 0 || ring->spaceFd < 0) {
+    fprintf(stderr, "\nError: shm_ring_create: eventfd failed\n");
+    perror("\t");
+    munmap(ring, sizeof(struct ShmRing));
+    return NULL;
+  }
+  ring->head = 0;
+  ring->tail = 0;
+  // The consumer starts out waiting with a clear eventfd, the producer not
+  ring->waiting = 1;
+  ring->writerWaiting = 0;
+  ring->writerArmed = 0;
+  return ring;
+}  // End of shm_ring_create()
+
+int shm_ring_fd(struct ShmRing *ring) { return ring->efd; }
+
+int shm_ring_space_fd(struct ShmRing *ring) { return ring->spaceFd; }
+
+/* Copies as much of buf as fits into the ring and publishes it. Returns the
+ * number of bytes copied. */
+static int shm_ring_put(struct ShmRing *ring, const char *buf, int len) {
+  unsigned int tail = ring->tail;
+  unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  unsigned int room = SHM_RING_BYTES - (tail - head);
+  if (room < (unsigned int)len) {
+    len = room;
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  unsigned int offset = tail & (SHM_RING_BYTES - 1);
+  unsigned int first = SHM_RING_BYTES - offset;
+  if (first > (unsigned int)len) {
+    first = len;
+  }
+  memcpy(ring->data + offset, buf, first);
+  memcpy(ring->data, buf + first, len - first);
+  __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+
+  // Pairs with the fence in shm_ring_read(): either the consumer sees the
+  // new tail, or this sees it waiting
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_ACQ_REL)) {
+    uint64_t one = 1;
+    write(ring->efd, &one, sizeof(one));
+  }
+  return len;
+}  // End of shm_ring_put()
+
+int shm_ring_write(struct ShmRing *ring, const char *buf, int len) {
+  if (ring->writerArmed &&
+      !__atomic_load_n(&ring->writerWaiting, __ATOMIC_RELAXED)) {
+    // The consumer made room and signalled spaceFd
+    uint64_t count;
+    read(ring->spaceFd, &count, sizeof(count));
+    ring->writerArmed = 0;
+  }
+
+  int written = shm_ring_put(ring, buf, len);
+  if (written < len && !ring->writerArmed) {
+    // Ask to be woken once there is room, then check again for room made
+    // before the consumer could see the flag
+    __atomic_store_n(&ring->writerWaiting, 1, __ATOMIC_RELAXED);
+    ring->writerArmed = 1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    written += shm_ring_put(ring, buf + written, len - written);
+  }
+  return written;
+}  // End of shm_ring_write()
+
+int shm_ring_read(struct ShmRing *ring, char *buf, int max) {
+  unsigned int head = ring->head;
+  unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (tail == head) {
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED)) {
+      // Still armed, so the producer has not written anything since
+      return 0;
+    }
+    // The producer woke us; clear the eventfd, then re-arm and check again
+    // for bytes written before the producer could see the flag
+    uint64_t count;
+    read(ring->efd, &count, sizeof(count));
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (tail == head) {
+      return 0;
+    }
+  }
+
+  unsigned int len = tail - head;
+  if (len > (unsigned int)max) {
+    len = max;
+  }
+  unsigned int offset = head & (SHM_RING_BYTES - 1);
+  unsigned int first = SHM_RING_BYTES - offset;
+  if (first > len) {
+    first = len;
+  }
+  memcpy(buf, ring->data + offset, first);
+  memcpy(buf + first, ring->data, len - first);
+  __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+
+  // Pairs with the fence in shm_ring_write()
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->writerWaiting, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&ring->writerWaiting, 0, __ATOMIC_ACQ_REL)) {
+    uint64_t one = 1;
+    write(ring->spaceFd, &one, sizeof(one));
+  }
+  return len;
+}  // End of shm_ring_read()
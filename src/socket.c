@@ -2,12 +2,18 @@
 socket.t
 */
 
+#define _GNU_SOURCE  // sendmmsg() and recvmmsg()
 #include "socket.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/un.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/select.h>
 #include <unistd.h>
 
 #include "color.h"
@@ -20,6 +26,11 @@ int sock_server_init(const char* localDomain, const int localPort) {
     return -1;
   }
 
+  // A restarted simulation can reuse the port while connections of the last
+  // run are still in TIME_WAIT
+  int one = 1;
+  setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
   // bind to local domain and port
   struct sockaddr_in server_addr;
   server_addr.sin_family = AF_INET;
@@ -35,7 +46,8 @@ int sock_server_init(const char* localDomain, const int localPort) {
     return -1;
   }
 
-  // set socket to listen for incoming connections
+  // set socket to listen for incoming connections; accept() is only tried
+  // once the event loop reports the socket readable, so it must not block
   int listen_result = listen(sock_fd, SOMAXCONN);
   if (listen_result < 0) {
     fprintf(
@@ -46,84 +58,69 @@ int sock_server_init(const char* localDomain, const int localPort) {
     close(sock_fd);
     return -1;
   }
+  fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
 
   return sock_fd;
 }
 
-int sock_recv(const int sockfd, char* buffer, const int bufferMax,
-              const char* remoteDomain) {
+int sock_accept(const int sockfd, const char* remoteDomain) {
   struct sockaddr_in remote_addr;
   socklen_t addr_len = sizeof(remote_addr);
-  int bytesRead = 0;
-
-  fd_set read_fds;
-  FD_ZERO(&read_fds);
-  FD_SET(sockfd, &read_fds);
-
-  struct timeval timeout;
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 6500;
 
   while (1) {
-    // Use select to wait for incoming data on the socket
-    int select_result = select(sockfd + 1, &read_fds, NULL, NULL, &timeout);
-    if (select_result < 0) {
-      fprintf(stderr, "\nError: sock_recv: select failed\n");
-      perror("\t");
-      return -1;
-    } else if (select_result == 0) {
-      // No data available within timeout period
-      return 0;
-    }
-
-    // Incoming data available, accept the incoming connection and read data
     int client_fd = accept(sockfd, (struct sockaddr*)&remote_addr, &addr_len);
     if (client_fd < 0) {
-      fprintf(stderr, "\nError: sock_recv: failed to accept connection\n");
-      perror("\t");
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf(stderr, "\nError: sock_accept: failed to accept connection\n");
+        perror("\t");
+      }
       return -1;
-    } else {
+    }
 #ifdef SOCKET_DEBUG
-      colorPrint(MAGENTA, "SOCK_RECV: accepted connection from %s:%d\n",
-                 inet_ntoa(remote_addr.sin_addr), ntohs(remote_addr.sin_port));
+    colorPrint(MAGENTA, "SOCK_ACCEPT: accepted connection from %s:%d\n",
+               inet_ntoa(remote_addr.sin_addr), ntohs(remote_addr.sin_port));
 #endif
-    }
 
-    // Check if the remote address and port match the desired address
+    // Check if the remote address matches the desired address
     if (strcmp(remoteDomain, inet_ntoa(remote_addr.sin_addr))) {
       colorPrint(BOLD_MAGENTA, "Connection not from desired remote address\n");
       close(client_fd);
-      continue;  // Connection not from desired remote address and port,
-                 // continue waiting
+      continue;  // Connection not from desired remote address, try the next
     }
 
-    // Incoming data available, read it into the buffer
-    bytesRead = recv(client_fd, buffer, bufferMax, 0);
-    if (bytesRead < 0) {
-      fprintf(stderr, "\nError: sock_recv: failed to read data\n");
-      perror("\t");
-      close(client_fd);
-      return -1;
-    }
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    return client_fd;
+  }
+}
 
-    close(client_fd);
-    break;  // Successfully read data from the desired remote address and port,
-            // exit loop
+int sock_recv(const int sockfd, char* buffer, const int bufferMax) {
+  int bytesRead = recv(sockfd, buffer, bufferMax, 0);
+  if (bytesRead < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      // Nothing has arrived yet
+      return 0;
+    }
+    fprintf(stderr, "\nError: sock_recv: failed to read data\n");
+    perror("\t");
+    return -1;
+  }
+  if (bytesRead == 0) {
+    // The remote node closed the connection
+    return -1;
   }
 
 #ifdef SOCKET_DEBUG
-  colorPrint(MAGENTA, "SOCK_RECV: received %d bytes from %s:%d\n", bytesRead,
-             inet_ntoa(remote_addr.sin_addr), ntohs(remote_addr.sin_port));
+  colorPrint(MAGENTA, "SOCK_RECV: received %d bytes\n", bytesRead);
 #endif
 
   return bytesRead;
 }
 
-int sock_send(const char* localDomain, const char* remoteDomain,
-              const int remotePort, char* msg, int msgLen) {
-  int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+int sock_connect(const char* localDomain, const char* remoteDomain,
+                 const int remotePort) {
+  int sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
   if (sock_fd < 0) {
-    fprintf(stderr, "\nError: sock_send: failed to create socket\n");
+    fprintf(stderr, "\nError: sock_connect: failed to create socket\n");
     perror("\t");
     return -1;
   }
@@ -136,17 +133,12 @@ int sock_send(const char* localDomain, const char* remoteDomain,
   int bind_result =
       bind(sock_fd, (struct sockaddr*)&local_addr, sizeof(local_addr));
   if (bind_result < 0) {
-    fprintf(stderr, "\nError: sock_send: failed to bind local port\n");
+    fprintf(stderr, "\nError: sock_connect: failed to bind local port\n");
     perror("\t");
     close(sock_fd);
     return -1;
   }
 
-  // Get the local port assigned by the OS
-  struct sockaddr_in local_addr_assigned;
-  socklen_t addr_len = sizeof(local_addr_assigned);
-  getsockname(sock_fd, (struct sockaddr*)&local_addr_assigned, &addr_len);
-
   // Connect to remote server
   struct sockaddr_in server_addr;
   server_addr.sin_family = AF_INET;
@@ -154,29 +146,316 @@ int sock_send(const char* localDomain, const char* remoteDomain,
   server_addr.sin_port = htons(remotePort);
   int connect_result =
       connect(sock_fd, (struct sockaddr*)&server_addr, sizeof(server_addr));
-  if (connect_result < 0) {
-    fprintf(stderr, "\nError: sock_send: connect_result < 0\n");
+  if (connect_result < 0 && errno != EINPROGRESS) {
+    fprintf(stderr, "\nError: sock_connect: failed to connect to %s:%d\n",
+            remoteDomain, remotePort);
     perror("\t");
     close(sock_fd);
     return -1;
   }
 
-  // Send data to remote server
-  int bytesSent = send(sock_fd, msg, msgLen, 0);
-  if (bytesSent < 0) {
-    fprintf(stderr, "\nError: sock_send: bytesSent < 0\n");
+  // Batches are flushed as whole writes already; don't hold them back
+  int one = 1;
+  setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+#ifdef SOCKET_DEBUG
+  struct sockaddr_in local_addr_assigned;
+  socklen_t addr_len = sizeof(local_addr_assigned);
+  getsockname(sock_fd, (struct sockaddr*)&local_addr_assigned, &addr_len);
+  colorPrint(MAGENTA, "SOCK_CONNECT: connecting to %s:%d from local port %d\n",
+             remoteDomain, remotePort, ntohs(local_addr_assigned.sin_port));
+#endif
+
+  return sock_fd;
+}
+
+int sock_connected(const int sockfd) {
+  struct pollfd pfd = {sockfd, POLLOUT, 0};
+  if (poll(&pfd, 1, 0) == 0) {
+    return 0;
+  }
+
+  int err = 0;
+  socklen_t errLen = sizeof(err);
+  getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+  if (err != 0) {
+    errno = err;
+    fprintf(stderr, "\nError: sock_connected: connection failed\n");
     perror("\t");
-    close(sock_fd);
     return -1;
   }
+  return 1;
+}
 
-  close(sock_fd);
+int sock_send(const int sockfd, const char* msg, const int msgLen) {
+  int bytesSent = 0;
+  while (bytesSent < msgLen) {
+    // MSG_NOSIGNAL: a closed connection is reported here, not by SIGPIPE
+    int n = send(sockfd, msg + bytesSent, msgLen - bytesSent, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // The socket buffer is full; the rest goes out later
+        break;
+      }
+      fprintf(stderr, "\nError: sock_send: failed to send data\n");
+      perror("\t");
+      return -1;
+    }
+    bytesSent += n;
+  }
 
 #ifdef SOCKET_DEBUG
-  colorPrint(MAGENTA, "SOCK_SEND: sent %d bytes to %s:%d from local port\n",
-             bytesSent, remoteDomain, remotePort,
-             ntohs(local_addr_assigned.sin_port));
+  colorPrint(MAGENTA, "SOCK_SEND: sent %d bytes\n", bytesSent);
 #endif
 
   return bytesSent;
 }
+
+int sock_udp_init(const char* localDomain, const int localPort,
+                  const char* remoteDomain, const int remotePort) {
+  int sock_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (sock_fd < 0) {
+    fprintf(stderr, "\nError: sock_udp_init: failed to create socket\n");
+    perror("\t");
+    return -1;
+  }
+
+  int one = 1;
+  setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  // bind to local domain and port
+  struct sockaddr_in local_addr;
+  local_addr.sin_family = AF_INET;
+  local_addr.sin_addr.s_addr = inet_addr(localDomain);
+  local_addr.sin_port = htons(localPort);
+  if (bind(sock_fd, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
+    fprintf(stderr, "\nError: sock_udp_init: failed to bind %s:%d\n",
+            localDomain, localPort);
+    perror("\t");
+    close(sock_fd);
+    return -1;
+  }
+
+  // Connecting sets the destination of every send and only lets datagrams
+  // from the remote end in
+  struct sockaddr_in remote_addr;
+  remote_addr.sin_family = AF_INET;
+  remote_addr.sin_addr.s_addr = inet_addr(remoteDomain);
+  remote_addr.sin_port = htons(remotePort);
+  if (connect(sock_fd, (struct sockaddr*)&remote_addr, sizeof(remote_addr)) <
+      0) {
+    fprintf(stderr, "\nError: sock_udp_init: failed to connect to %s:%d\n",
+            remoteDomain, remotePort);
+    perror("\t");
+    close(sock_fd);
+    return -1;
+  }
+
+  return sock_fd;
+}
+
+int sock_udp_send(const int sockfd, char* buffer, const int* lens,
+                  const int count) {
+  struct mmsghdr msgs[SOCK_UDP_BATCH];
+  struct iovec iov[SOCK_UDP_BATCH];
+  int numSent = 0;
+
+  while (numSent < count) {
+    int n = 0;
+    for (; n < SOCK_UDP_BATCH && numSent + n < count; n++) {
+      iov[n].iov_base = buffer;
+      iov[n].iov_len = lens[numSent + n];
+      buffer += lens[numSent + n];
+      memset(&msgs[n].msg_hdr, 0, sizeof(msgs[n].msg_hdr));
+      msgs[n].msg_hdr.msg_iov = &iov[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+    }
+
+    int sent = sendmmsg(sockfd, msgs, n, 0);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED) {
+        // A full socket buffer or an absent remote end loses the datagrams,
+        // just as a network would
+        return numSent;
+      }
+      fprintf(stderr, "\nError: sock_udp_send: failed to send datagrams\n");
+      perror("\t");
+      return -1;
+    }
+    numSent += sent;
+    if (sent < n) {
+      // The datagrams after the first failed one are lost
+      break;
+    }
+  }
+
+#ifdef SOCKET_DEBUG
+  colorPrint(MAGENTA, "SOCK_UDP_SEND: sent %d datagrams\n", numSent);
+#endif
+
+  return numSent;
+}
+
+int sock_udp_recv(const int sockfd, char* slots, const int slotSize,
+                  int* lens, const int max) {
+  struct mmsghdr msgs[SOCK_UDP_BATCH];
+  struct iovec iov[SOCK_UDP_BATCH];
+  int n = (max < SOCK_UDP_BATCH) ? max : SOCK_UDP_BATCH;
+
+  for (int i = 0; i < n; i++) {
+    iov[i].iov_base = slots + i * slotSize;
+    iov[i].iov_len = slotSize;
+    memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  int received = recvmmsg(sockfd, msgs, n, MSG_DONTWAIT, NULL);
+  if (received < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED ||
+        errno == EINTR) {
+      // Nothing has arrived; a refused earlier send is not an error here
+      return 0;
+    }
+    fprintf(stderr, "\nError: sock_udp_recv: failed to read datagrams\n");
+    perror("\t");
+    return -1;
+  }
+
+  for (int i = 0; i < received; i++) {
+    // Datagrams longer than a slot were truncated and cannot be decoded
+    lens[i] =
+        (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? -1 : (int)msgs[i].msg_len;
+  }
+  return received;
+}
+
+/* Fills addr with the AF_UNIX address of path. Returns its length, or -1 if
+ * the path is too long. */
+static int sock_local_addr(const char* path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "\nError: socket path %s is too long\n", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return sizeof(*addr);
+}
+
+int sock_local_server_init(const char* localPath) {
+  struct sockaddr_un addr;
+  int addrLen = sock_local_addr(localPath, &addr);
+  if (addrLen < 0) {
+    return -1;
+  }
+
+  int sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+  if (sock_fd < 0) {
+    fprintf(stderr,
+            "\nError: sock_local_server_init: failed to create socket\n");
+    perror("\t");
+    return -1;
+  }
+
+  // A socket file left behind by an earlier run would make bind() fail
+  unlink(localPath);
+  if (bind(sock_fd, (struct sockaddr*)&addr, addrLen) < 0) {
+    fprintf(stderr, "\nError: sock_local_server_init: failed to bind %s\n",
+            localPath);
+    perror("\t");
+    close(sock_fd);
+    return -1;
+  }
+  if (listen(sock_fd, SOMAXCONN) < 0) {
+    fprintf(stderr, "\nError: sock_local_server_init: failed to listen on %s\n",
+            localPath);
+    perror("\t");
+    close(sock_fd);
+    return -1;
+  }
+  return sock_fd;
+}
+
+int sock_local_accept(const int sockfd) {
+  int client_fd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK);
+  if (client_fd < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    fprintf(stderr,
+            "\nError: sock_local_accept: failed to accept connection\n");
+    perror("\t");
+  }
+  return client_fd;
+}
+
+int sock_local_connect(const char* remotePath) {
+  struct sockaddr_un addr;
+  int addrLen = sock_local_addr(remotePath, &addr);
+  if (addrLen < 0) {
+    return -1;
+  }
+
+  int sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+  if (sock_fd < 0) {
+    fprintf(stderr, "\nError: sock_local_connect: failed to create socket\n");
+    perror("\t");
+    return -1;
+  }
+  // A local connect completes at once or fails; there is no handshake to
+  // wait for
+  if (connect(sock_fd, (struct sockaddr*)&addr, addrLen) < 0) {
+#ifdef SOCKET_DEBUG
+    colorPrint(MAGENTA, "SOCK_LOCAL_CONNECT: %s: %s\n", remotePath,
+               strerror(errno));
+#endif
+    close(sock_fd);
+    return -1;
+  }
+  return sock_fd;
+}
+
+int sock_local_send(const int sockfd, const char* msg, const int msgLen) {
+  while (send(sockfd, msg, msgLen, MSG_NOSIGNAL) < 0) {
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      // The receiver is behind; the caller keeps the record queued and
+      // sends it once the socket is writable again
+      return 0;
+    }
+    fprintf(stderr, "\nError: sock_local_send: failed to send data\n");
+    perror("\t");
+    return -1;
+  }
+  return 1;
+}
+
+int sock_local_recv(const int sockfd, char* buffer, const int bufferMax) {
+  struct iovec iov = {buffer, bufferMax};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  int bytesRead = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+  if (bytesRead < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return 0;
+    }
+    fprintf(stderr, "\nError: sock_local_recv: failed to read data\n");
+    perror("\t");
+    return -1;
+  }
+  if (bytesRead == 0) {
+    // The remote node closed the connection
+    return -1;
+  }
+  if (msg.msg_flags & MSG_TRUNC) {
+    fprintf(stderr, "\nError: sock_local_recv: dropping an oversized record\n");
+    return 0;
+  }
+  return bytesRead;
+}
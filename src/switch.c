@@ -4,6 +4,8 @@
 
 #include "switch.h"
 
+#include <arpa/inet.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
@@ -12,310 +14,627 @@
 #include "color.h"
 #include "constants.h"
 #include "debug.h"
-#include "job.h"
+#include "eventLoop.h"
 #include "net.h"
 #include "packet.h"
+#include "route.h"
+#include "scheduler.h"
 
-#define MAX_NUM_ROUTES 100
-#define MAX_ADDRESS 255
-
-// Used for searchRoutingTableForValidID when port is unknown
+// Port of a node missing from the forwarding table
 #define UNKNOWN -1
 #define YES 1
 #define NO 0
 
 #define DEFAULT_TREE_STATE NO
 
+// Set by switch_use_ecmp() before the switches start
+static int g_ecmp = 0;
+
+/* What a switch last heard from the node on one of its ports. */
+struct StpNeighbor {
+  int alive;  // Heard from within STP_HOLD_MS
+  long long lastHeardMs;
+  char senderType;     // 'S' for a switch, 'X' for an endpoint
+  char isSenderChild;  // 'Y' if this switch is the neighbor's parent
+  int rootId;
+  int rootDist;
+  int replyDue;  // The neighbor is new and is sent our state this step
+};
+
 struct SwitchNodeContext {
   int _id;
   struct Net_port **node_port_array;
   int node_port_array_size;
-  struct JobQueue **jobq;
-  struct TableEntry **routingtable;
+  struct ForwardingTable fdb;  // Port each learned node is reached through
+  long long nowMs;  // Time of the current wakeup
   int localRootID;
   int localRootDist;
   int localParentID;
-  int *localPortTree;
+  struct StpNeighbor *stpNeighbors;
+  int stpUpdateDue;  // Every port is sent our state at the end of the step
+  struct RouteTable routes;  // Shortest paths to the endpoints, in ECMP mode
+  int routeUpdateDue;        // A route changed and is advertised this step
+  // Bit i of treePorts is set while port i is on the spanning tree
+  uint64_t *treePorts;
+  struct EventLoop loop;
+  unsigned int numCtrlMsgsSent;
+  struct PacketPool pktPool;
+#ifdef SWITCH_DEBUG_QUEUE
+  unsigned long long *reportedDrops;  // Drops of each port when last reported
+  long long lastQueueReportMs;        // When the ports were last checked
+#endif
 };
 
 long long current_time_ms() {
+  if (event_loop_virtual_time()) {
+    return event_loop_virtual_now_ms();
+  }
   struct timeval tv;
   gettimeofday(&tv, NULL);
   return (long long)(tv.tv_sec) * 1000 + (long long)(tv.tv_usec) / 1000;
 }
 
-void addToRoutingTable(struct SwitchNodeContext *sw, int id, int port);
-void broadcastToAllButSender(struct SwitchNodeContext *sw, struct Job *job);
+void broadcastToAllButSender(struct SwitchNodeContext *sw, struct Packet *pkt,
+                             int senderPort);
 int createTreePayload(char *dst, int packetRootID, int packetRootDist,
-                      char packetSenderType, char packetIsSenderChild);
+                      char packetSenderType, char packetIsSenderChild,
+                      unsigned int seq);
 void handleControlPacket(struct SwitchNodeContext *sw, const int receivePort,
                          struct Packet *pkt);
+void receiveFromPort(struct SwitchNodeContext *sw, int portNum);
 struct SwitchNodeContext *initSwitchNodeContext(int switch_id);
 void controlPacketSender_switch(struct SwitchNodeContext *sw,
                                 const char nodeType);
-int searchRoutingTableForValidID(struct SwitchNodeContext *sw, int id,
-                                 int port);
+static void fdb_expire(struct ForwardingTable *table, long long nowMs);
+static void stpRecompute(struct SwitchNodeContext *sw);
+static void stpExpireNeighbors(struct SwitchNodeContext *sw);
+static void stpSendToPort(struct SwitchNodeContext *sw, int port,
+                          const char nodeType, unsigned int seq);
+static void routeRecompute(struct SwitchNodeContext *sw);
+static void routeSendUpdates(struct SwitchNodeContext *sw);
+#ifdef SWITCH_DEBUG_QUEUE
+static void reportQueueDrops(struct SwitchNodeContext *sw);
+#endif
+int fdb_learn_and_lookup(struct SwitchNodeContext *sw, int src, int port,
+                         int dst);
 int setLocalPortTreeState(struct SwitchNodeContext *sw, int portToSet,
                           int stateToSet);
 
+// Ports per word of a switch's treePorts bitset
+#define TREE_PORT_BITS 64
+
+static int isTreePort(const struct SwitchNodeContext *sw, int port) {
+  return (sw->treePorts[port / TREE_PORT_BITS] >> (port % TREE_PORT_BITS)) & 1;
+}
+
 void switch_main(int switch_id) {
   // Initialize Switch State
   struct SwitchNodeContext *sw = initSwitchNodeContext(switch_id);
 
-  unsigned int numCtrlMsgsSent = 0;
-  static long long timeLast = 0;
-
+  int timeout = 0;
   while (1) {
-    ////////////////////////////////////////////////////////////////////////////
-    ////////////////////////////// PACKET HANDLER //////////////////////////////
-
-    // Periodically broadcast STP Control Packets
-    long long timeNow = current_time_ms();
-    if (timeNow - timeLast > PERIODIC_CTRL_MSG_WAITTIME_MS &&
-        numCtrlMsgsSent < ALLOWED_CONVERGENCE_ROUNDS) {
-      numCtrlMsgsSent++;
-      controlPacketSender_switch(sw, 'S');
-      timeLast = timeNow;
-    }
-
-    for (int portNum = 0; portNum < sw->node_port_array_size; portNum++) {
-      struct Packet *inPkt = (struct Packet *)malloc(sizeof(struct Packet));
-      int n = packet_recv(sw->node_port_array[portNum], inPkt);
-
-      if (n > 0) {
-        // Packet was received on port
+    // Don't block while there is still buffered input
+    timeout = switch_step(sw, timeout) ? 0 : -1;
+  } /* End of while loop */
 
-        if (inPkt->type == PKT_CONTROL) {
-          handleControlPacket(sw, portNum, inPkt);
-          packet_delete(inPkt);
-        } else {
-// incoming packet is not a control packet
-#ifdef SWITCH_DEBUG_PACKET_RECEIPT
-          colorPrint(BLUE, "Switch%d received packet: ", sw->_id);
-          printPacket(inPkt);
-#endif
-          // Ensure that sender of received packet is in the routing table
-          if (searchRoutingTableForValidID(sw, inPkt->src, portNum) ==
-              UNKNOWN) {
-            // Sender was not found in routing table
-            addToRoutingTable(sw, inPkt->src, portNum);
-          }
-
-          // Create a job to enqueue with work
-          struct Job *swJob = job_create_empty();
-          swJob->packet = inPkt;
-
-          // Search for destination in routing table
-          int dstIndex = searchRoutingTableForValidID(sw, inPkt->dst, UNKNOWN);
-          if (dstIndex < 0) {
-            // destination of received packet is not in routing table...
-            // enqueue job to broadcast packet to all connected hosts
-            swJob->type = JOB_BROADCAST_PKT;
-            job_enqueue(sw->_id, *sw->jobq, swJob);
-
-          } else {
-            // destination of received packet has been found in routing
-            // table... enqueue job to forward packet to the associated port
-            swJob->type = JOB_FORWARD_PKT;
-            job_enqueue(sw->_id, *sw->jobq, swJob);
-          }
-        }
-      }
+}  // End of switch_main()
 
-      else {
-        // No packet was received on port, so discard packet
-        packet_delete(inPkt);
-      }
+/*
+Runs one wakeup of the switch: waits up to timeoutMs for a port or the STP
+timer and switches what is ready. Control packets only go out when the
+switch's place in the spanning tree changed, to a newly heard neighbor, or as a
+keepalive when the timer fires. Returns 1 if more input is already waiting.
+*/
+int switch_step(void *context, int timeoutMs) {
+  struct SwitchNodeContext *sw = (struct SwitchNodeContext *)context;
+  struct Event events[EVENT_LOOP_MAX_EVENTS];
+
+  // Sleep until a port is readable or the STP timer fires
+  int numEvents =
+      event_loop_wait(&sw->loop, events, EVENT_LOOP_MAX_EVENTS, timeoutMs);
+
+  // Nodes that went quiet are forgotten before any packet is looked up
+  sw->nowMs = current_time_ms();
+  fdb_expire(&sw->fdb, sw->nowMs);
+
+  ////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////// PACKET HANDLER //////////////////////////////
+
+  for (int e = 0; e < numEvents; e++) {
+    if (events[e].kind == EVENT_TIMER) {
+      // Drop the neighbors that went quiet, then send a keepalive
+      stpExpireNeighbors(sw);
+      sw->stpUpdateDue = 1;
+    } else if (events[e].kind == EVENT_PORT) {
+      receiveFromPort(sw, events[e].index);
     }
+  }
 
-    ////////////////////////////// PACKET HANDLER //////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////
-    // -------------------------------------------------------------------------
-    ////////////////////////////////////////////////////////////////////////////
-    //////////////////////////////// JOB HANDLER ///////////////////////////////
-
-    if (job_queue_length(*sw->jobq) > 0) {
-      /* Get a new job from the job queue */
-      struct Job *job_from_queue = job_dequeue(sw->_id, *sw->jobq);
-
-      //////////// EXECUTE FETCHED JOB ////////////
-      switch (job_from_queue->type) {
-        case JOB_BROADCAST_PKT:
-          broadcastToAllButSender(sw, job_from_queue);
-          break;
-
-        case JOB_FORWARD_PKT:
-          int dstPort = searchRoutingTableForValidID(
-              sw, job_from_queue->packet->dst, UNKNOWN);
-          packet_send(sw->node_port_array[dstPort], job_from_queue->packet);
-          break;
-
-        default:
-          fprintf(stderr,
-                  "Switch%d's Job Handler encountered an unknown job type\n",
-                  sw->_id);
+  // One update per step, however many control packets caused it. Routes go
+  // first, while the neighbors that are owed a reply are still marked
+  if (g_ecmp) {
+    routeSendUpdates(sw);
+  }
+  if (sw->stpUpdateDue) {
+    controlPacketSender_switch(sw, 'S');
+  } else {
+    for (int i = 0; i < sw->node_port_array_size; i++) {
+      if (sw->stpNeighbors[i].replyDue) {
+        stpSendToPort(sw, i, 'S', sw->numCtrlMsgsSent++);
       }
-
-      // free(job_from_queue->packet);
-      // job_from_queue->packet = NULL;
-      // free(job_from_queue);
-      // job_from_queue = NULL;
     }
+  }
 
-    //////////////////////////////// JOB HANDLER ///////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////// PACKET HANDLER //////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////
 
-    /* The host goes to sleep for 10 ms */
-    usleep(LOOP_SLEEP_TIME_US);
-  } /* End of while loop */
+  packet_flush(sw->node_port_array, sw->node_port_array_size);
+  event_loop_flush(&sw->loop);
+#ifdef SWITCH_DEBUG_QUEUE
+  if (sw->nowMs - sw->lastQueueReportMs >= SWITCH_QUEUE_REPORT_MS) {
+    sw->lastQueueReportMs = sw->nowMs;
+    reportQueueDrops(sw);
+  }
+#endif
+  return event_loop_pending(&sw->loop);
+}  // End of switch_step()
 
-}  // End of switch_main()
+void switch_task_init(struct NodeTask *task, int switch_id) {
+  struct SwitchNodeContext *sw = initSwitchNodeContext(switch_id);
+  task->id = switch_id;
+  task->context = sw;
+  task->step = switch_step;
+  task->loop = &sw->loop;
+}  // End of switch_task_init()
 
 ////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////
 ////////////////////////// HELPER FUNCTIONS ////////////////////////////////
 
-void addToRoutingTable(struct SwitchNodeContext *sw, int id, int port) {
+#define FDB_SLOT_MASK (2 * FDB_CAPACITY - 1)
+
+/* Returns the slot an id hashes to. */
+static int fdb_home(int id) {
+  // Fibonacci hashing spreads sequential ids over the slots
+  return ((unsigned int)id * 2654435769u) & FDB_SLOT_MASK;
+}  // End of fdb_home()
+
+static void fdb_init(struct ForwardingTable *table) {
+  for (int i = 0; i <= FDB_SLOT_MASK; i++) {
+    table->slots[i].entry = -1;
+  }
+  for (int i = 0; i < FDB_CAPACITY; i++) {
+    table->entries[i].next = (i + 1 < FDB_CAPACITY) ? i + 1 : -1;
+  }
+  table->freeList = 0;
+  table->lruHead = -1;
+  table->lruTail = -1;
+  table->numEntries = 0;
+}  // End of fdb_init()
+
+/* Returns the slot holding id, or the free slot where id belongs. */
+static int fdb_probe(struct ForwardingTable *table, int id) {
+  int i = fdb_home(id);
+  while (table->slots[i].entry >= 0 && table->slots[i].id != id) {
+    i = (i + 1) & FDB_SLOT_MASK;
+  }
+  return i;
+}  // End of fdb_probe()
+
+static void fdb_lru_unlink(struct ForwardingTable *table, int e) {
+  struct FdbEntry *entry = &table->entries[e];
+  if (entry->prev >= 0) {
+    table->entries[entry->prev].next = entry->next;
+  } else {
+    table->lruHead = entry->next;
+  }
+  if (entry->next >= 0) {
+    table->entries[entry->next].prev = entry->prev;
+  } else {
+    table->lruTail = entry->prev;
+  }
+}  // End of fdb_lru_unlink()
+
+static void fdb_lru_push(struct ForwardingTable *table, int e) {
+  struct FdbEntry *entry = &table->entries[e];
+  entry->prev = -1;
+  entry->next = table->lruHead;
+  if (table->lruHead >= 0) {
+    table->entries[table->lruHead].prev = e;
+  } else {
+    table->lruTail = e;
+  }
+  table->lruHead = e;
+}  // End of fdb_lru_push()
+
+/* Forgets entry e. Its slot is refilled by shifting back the ids probed past
+ * it, so lookups never have to skip deleted slots. */
+static void fdb_remove(struct ForwardingTable *table, int e) {
+  int hole = fdb_probe(table, table->entries[e].id);
+  int i = hole;
+  while (1) {
+    i = (i + 1) & FDB_SLOT_MASK;
+    if (table->slots[i].entry < 0) {
+      break;
+    }
+    // The id in slot i may fill the hole only if its home slot does not lie
+    // cyclically within (hole, i]
+    int home = fdb_home(table->slots[i].id);
+    if (((i - home) & FDB_SLOT_MASK) >= ((i - hole) & FDB_SLOT_MASK)) {
+      table->slots[hole] = table->slots[i];
+      hole = i;
+    }
+  }
+  table->slots[hole].entry = -1;
+
+  fdb_lru_unlink(table, e);
+  table->entries[e].next = table->freeList;
+  table->freeList = e;
+  table->numEntries--;
+}  // End of fdb_remove()
+
+/* Forgets every node not heard from within FDB_AGING_MS before nowMs. The
+ * least recently heard nodes are at the tail, so this stops at the first
+ * fresh one. */
+static void fdb_expire(struct ForwardingTable *table, long long nowMs) {
+  while (table->lruTail >= 0 &&
+         nowMs - table->entries[table->lruTail].lastSeenMs > FDB_AGING_MS) {
+    fdb_remove(table, table->lruTail);
+  }
+}  // End of fdb_expire()
+
+/* Forgets every node learned on port, e.g. once it leaves the spanning tree. */
+static void fdb_flush_port(struct ForwardingTable *table, int port) {
+  int e = table->lruHead;
+  while (e >= 0) {
+    int next = table->entries[e].next;
+    if (table->entries[e].port == port) {
+      fdb_remove(table, e);
+    }
+    e = next;
+  }
+}  // End of fdb_flush_port()
+
+/*
+Learns that src is reached through port, then returns the port dst is reached
+through, or UNKNOWN if dst has not been heard from within FDB_AGING_MS. A node
+heard on another port than before moves to the new one at once.
+*/
+int fdb_learn_and_lookup(struct SwitchNodeContext *sw, int src, int port,
+                         int dst) {
+  struct ForwardingTable *table = &sw->fdb;
+  long long nowMs = sw->nowMs;
+
+  int slot = fdb_probe(table, src);
+  int e = table->slots[slot].entry;
+  if (e < 0) {
 #ifdef SWITCH_DEBUG
-  colorPrint(BLUE, "\tSwitch%d: Adding node_id%d to routing table on port%d\n",
-             sw->_id, id, port);
+    colorPrint(BLUE,
+               "\tSwitch%d: Adding node_id%d to routing table on port%d\n",
+               sw->_id, src, port);
 #endif
-  struct TableEntry *newEntry =
-      malloc(sizeof(struct TableEntry));  // Memory allocation added here
-  newEntry->id = id;
-  newEntry->next = sw->routingtable[port];
-  sw->routingtable[port] = newEntry;  // Assignment changed to address of new
-                                      // entry instead of its value
-}  // End of addToRoutingTable()
+    if (table->numEntries == FDB_CAPACITY) {
+      // Evicting shifts slots around, so probe again afterwards
+      fdb_remove(table, table->lruTail);
+      slot = fdb_probe(table, src);
+    }
+    e = table->freeList;
+    table->freeList = table->entries[e].next;
+    table->numEntries++;
+    table->entries[e].id = src;
+    table->slots[slot].id = src;
+    table->slots[slot].entry = e;
+  } else {
+#ifdef SWITCH_DEBUG
+    if (table->entries[e].port != port) {
+      colorPrint(BLUE, "\tSwitch%d: node_id%d moved from port%d to port%d\n",
+                 sw->_id, src, table->entries[e].port, port);
+    }
+#endif
+    fdb_lru_unlink(table, e);
+  }
+  table->entries[e].port = port;
+  table->entries[e].lastSeenMs = nowMs;
+  fdb_lru_push(table, e);
+
+  int dstPort = UNKNOWN;
+  e = table->slots[fdb_probe(table, dst)].entry;
+  if (e >= 0) {
+    if (nowMs - table->entries[e].lastSeenMs > FDB_AGING_MS) {
+      fdb_remove(table, e);
+    } else {
+      dstPort = table->entries[e].port;
+    }
+  }
+#ifdef SWITCH_DEBUG_ROUTINGTABLE
+  colorPrint(BLUE, "Switch%d: host%d is on port%d\n", sw->_id, dst, dstPort);
+#endif
+  return dstPort;
+}  // End of fdb_learn_and_lookup()
 
 /*
-This function takes a job struct , a table entry, an array of Net_port
-pointers and the size of the array as parameters. It then iterates through the
-port_array and sends the job's packet to each port in the array, except for the
-port that corresponds to the job->packet->src
+Sends pkt on every port of the spanning tree except senderPort, the port it
+arrived on. Only the set bits of the tree's port bitset are visited, so ports
+off the tree cost nothing.
 */
-void broadcastToAllButSender(struct SwitchNodeContext *sw, struct Job *job) {
-  int senderPort = searchRoutingTableForValidID(sw, job->packet->src, UNKNOWN);
-  if (senderPort < 0) {
-    fprintf(
-        stderr,
-        "Error: broadcastToAllButSender unable to find value for senderPort\n");
-    return;
+void broadcastToAllButSender(struct SwitchNodeContext *sw, struct Packet *pkt,
+                             int senderPort) {
+  int numWords =
+      (sw->node_port_array_size + TREE_PORT_BITS - 1) / TREE_PORT_BITS;
+  for (int w = 0; w < numWords; w++) {
+    uint64_t ports = sw->treePorts[w];
+    if (w == senderPort / TREE_PORT_BITS) {
+      ports &= ~((uint64_t)1 << (senderPort % TREE_PORT_BITS));
+    }
+    while (ports != 0) {
+      int i = w * TREE_PORT_BITS + __builtin_ctzll(ports);
+      ports &= ports - 1;  // Clear the lowest set bit
+      packet_send(sw->node_port_array[i], pkt);
+    }
   }
+}  // End of broadcastToAllButSender
 
-  // Iterate through all connected ports
-  // broadcast packet to all except senderPort
+#ifdef SWITCH_DEBUG_QUEUE
+/*
+Prints the queue counters of every port that dropped packets since the last
+check.
+*/
+static void reportQueueDrops(struct SwitchNodeContext *sw) {
   for (int i = 0; i < sw->node_port_array_size; i++) {
-    if (i != senderPort && sw->localPortTree[i] == YES) {
-      packet_send(sw->node_port_array[i], job->packet);
-      // printf("switch%d sending to port%d\n", sw->_id, i);
+    struct Net_port *port = sw->node_port_array[i];
+    struct PortQueueStats *stats = &port->queueStats;
+    unsigned long long drops = stats->tailDrops + stats->headDrops +
+                               stats->earlyDrops + stats->linkDrops +
+                               stats->mtuDrops;
+    if (drops == sw->reportedDrops[i]) {
+      continue;
     }
+    sw->reportedDrops[i] = drops;
+    colorPrint(YELLOW,
+               "Switch%d: port%d queue %d/%d bytes (max %d), %llu queued, "
+               "drops: %llu tail, %llu head, %llu early, %llu link, "
+               "%llu mtu\n",
+               sw->_id, i, port->outLen, PORT_QUEUE_BYTES,
+               stats->maxDepth, stats->enqueued, stats->tailDrops,
+               stats->headDrops, stats->earlyDrops, stats->linkDrops,
+               stats->mtuDrops);
   }
-}  // End of broadcastToAllButSender
+}  // End of reportQueueDrops()
+#endif
 
 int createTreePayload(char *buffer, int localRootID, int localRootDist,
-                      char senderType, char isSenderChild) {
-  // Calculate the total length of the payload string
-  int payloadLength = snprintf(NULL, 0, "9999:%d:%d:%c:%c", localRootID,
-                               localRootDist, senderType, isSenderChild);
-
-  // Create the payload string
-  snprintf(buffer, payloadLength + 1, "9999:%d:%d:%c:%c", localRootID,
-           localRootDist, senderType, isSenderChild);
-
-  // Return the length of the payload string
-  return payloadLength;
+                      char senderType, char isSenderChild, unsigned int seq) {
+  struct StpMsg msg;
+  msg.version = STP_VERSION;
+  msg.headerLen = sizeof(msg);
+  msg.senderType = senderType;
+  msg.isSenderChild = isSenderChild;
+  msg.rootId = htonl((uint32_t)localRootID);
+  msg.rootDist = htonl((uint32_t)localRootDist);
+  msg.seq = htonl(seq);
+  memcpy(buffer, &msg, sizeof(msg));
+
+  // Return the length of the payload
+  return sizeof(msg);
 }  // End of createTreePayload()
 
+/*
+Decodes the STP message carried by pkt into msg, in host byte order. Returns 0
+on success, or -1 if the payload is too short to hold one.
+*/
+static int parseTreePayload(const struct Packet *pkt, struct StpMsg *msg) {
+  if (pkt->length < (int)sizeof(*msg)) {
+    return -1;
+  }
+  memcpy(msg, pkt->payload, sizeof(*msg));
+  if (msg->headerLen < sizeof(*msg)) {
+    return -1;
+  }
+  msg->rootId = ntohl(msg->rootId);
+  msg->rootDist = ntohl(msg->rootDist);
+  msg->seq = ntohl(msg->seq);
+  return 0;
+}  // End of parseTreePayload()
+
 void handleControlPacket(struct SwitchNodeContext *sw, const int receivePort,
                          struct Packet *pkt) {
-  char *payload = pkt->payload;
-
-  /* Parsing Packet for various fields */
-  // Find the start of the localRootID field
-  char *packetRootID_str = payload + JIDLEN + 1;
-
-  // Convert the localRootID field string to an integer
-  int packetRootID = atoi(packetRootID_str);
-
-  // Find the start of the localRootDist field
-  char *packetRootDist_str = strchr(packetRootID_str, ':') + 1;
-  // Convert the localRootDist field string to an integer
-  int packetRootDist = atoi(packetRootDist_str);
-
-  // Find the start of the senderType field
-  char *packetSenderType = strchr(packetRootDist_str, ':') + 1;
+  struct StpMsg msg;
+  if (parseTreePayload(pkt, &msg) < 0) {
+    fprintf(stderr, "Switch%d dropped a malformed control packet on port%d\n",
+            sw->_id, receivePort);
+    return;
+  }
 
-  // Find the start of the isSenderChild field
-  char *packetIsSenderChild = strchr(packetSenderType, ':') + 1;
+  int packetRootID = (int)msg.rootId;
+  int packetRootDist = (int)msg.rootDist;
+  char *packetSenderType = (char *)&msg.senderType;
+  char *packetIsSenderChild = (char *)&msg.isSenderChild;
 
 #ifdef SWITCH_DEBUG_CONTROL_MSG
   colorPrint(BOLD_BLUE, "switch%d received: ", sw->_id);
   printPacket(pkt);
   colorPrint(BLUE,
              "\n\tpacketRootID:%d packetRootDist:%d packetSenderType:%c, "
-             "packetIsSenderChild:%c\n",
+             "packetIsSenderChild:%c seq:%u\n",
              packetRootID, packetRootDist, *packetSenderType,
-             *packetIsSenderChild);
+             *packetIsSenderChild, msg.seq);
+#endif
+
+  // A neighbor that is new, back after a timeout or restarted is sent our
+  // state at once instead of at the next keepalive
+  struct StpNeighbor *nb = &sw->stpNeighbors[receivePort];
+  if (!nb->alive || msg.seq == 0) {
+    nb->replyDue = 1;
+  }
+  nb->alive = 1;
+  nb->lastHeardMs = sw->nowMs;
+  nb->senderType = *packetSenderType;
+  nb->isSenderChild = *packetIsSenderChild;
+  nb->rootId = packetRootID;
+  nb->rootDist = packetRootDist;
+
+  stpRecompute(sw);
+  if (g_ecmp) {
+    route_set_port(&sw->routes, receivePort, nb->senderType == 'S',
+                   (nb->senderType == 'X') ? pkt->src : -1, 1);
+    routeRecompute(sw);
+  }
+}  // End of handleControlPacket()
+
+/*
+Elects the root, root distance and parent port from what the live neighbors
+last said, then puts each port on or off the spanning tree. Offers from
+children are skipped, since their path to the root runs through this switch,
+and offers at STP_MAX_DIST or beyond are ignored, so a root that was cut off
+stops circulating quickly. A change of root, distance or parent makes the
+switch send its state on every port.
+*/
+static void stpRecompute(struct SwitchNodeContext *sw) {
+  int rootID = sw->_id;
+  int rootDist = 0;
+  int parentID = -1;
+  for (int i = 0; i < sw->node_port_array_size; i++) {
+    struct StpNeighbor *nb = &sw->stpNeighbors[i];
+    if (!nb->alive || nb->senderType != 'S' || nb->isSenderChild == 'Y' ||
+        nb->rootDist >= STP_MAX_DIST) {
+      continue;
+    }
+    // Ties go to the lowest port
+    if (nb->rootId < rootID ||
+        (nb->rootId == rootID && nb->rootDist + 1 < rootDist)) {
+      rootID = nb->rootId;
+      rootDist = nb->rootDist + 1;
+      parentID = i;
+    }
+  }
+
+  if (rootID != sw->localRootID || rootDist != sw->localRootDist ||
+      parentID != sw->localParentID) {
+#ifdef SWITCH_DEBUG
+    colorPrint(RED,
+               "\t\tSwitch%d's localRootID updated from %d to "
+               "%d\n\t\t\tlocalParentID updated to %d\n"
+               "\t\t\tlocalRootDist updated to %d\n",
+               sw->_id, sw->localRootID, rootID, parentID, rootDist);
 #endif
+    sw->localRootID = rootID;
+    sw->localRootDist = rootDist;
+    sw->localParentID = parentID;
+    sw->stpUpdateDue = 1;
+  }
+
+  // A port is on the tree if it leads to an endpoint, to this switch's
+  // parent or to one of its children; any other switch-to-switch link would
+  // close a loop
+  for (int i = 0; i < sw->node_port_array_size; i++) {
+    struct StpNeighbor *nb = &sw->stpNeighbors[i];
+    int onTree = nb->alive &&
+                 (nb->senderType == 'X' ||
+                  (nb->senderType == 'S' &&
+                   (nb->isSenderChild == 'Y' || i == sw->localParentID)));
+    if (onTree != isTreePort(sw, i)) {
+      setLocalPortTreeState(sw, i, onTree ? YES : NO);
+    }
+  }
+}  // End of stpRecompute()
 
-  // Update localRootID, localRootDist, and localParent
-  if (*packetSenderType == 'S') {
-    if (packetRootID < sw->localRootID) {
+/*
+Forgets the neighbors not heard from within STP_HOLD_MS, e.g. behind a broken
+socket link or a node that was stopped, and rebuilds the tree without them.
+*/
+static void stpExpireNeighbors(struct SwitchNodeContext *sw) {
+  int expired = 0;
+  for (int i = 0; i < sw->node_port_array_size; i++) {
+    struct StpNeighbor *nb = &sw->stpNeighbors[i];
+    if (nb->alive && sw->nowMs - nb->lastHeardMs > STP_HOLD_MS) {
 #ifdef SWITCH_DEBUG
-      colorPrint(RED,
-                 "\t\tSwitch%d's localRootID updated from %d to "
-                 "%d\n\t\t\tlocalParentID updated to %d\n"
-                 "\t\t\tlocalRootDist updated to %d",
-                 sw->_id, sw->localRootID, packetRootID, receivePort,
-                 packetRootDist + 1);
+      colorPrint(RED, "\tSwitch%d lost the neighbor on port%d\n", sw->_id, i);
 #endif
-      sw->localRootID = packetRootID;
-      sw->localParentID = receivePort;
-      sw->localRootDist = packetRootDist + 1;
-    } else if (packetRootID == sw->localRootID) {
-      if (sw->localRootDist > packetRootDist + 1 ||
-          (sw->localRootDist == packetRootDist + 1 &&
-           receivePort < sw->localParentID)) {
-        sw->localParentID = receivePort;
-        sw->localRootDist = packetRootDist + 1;
+      nb->alive = 0;
+      expired = 1;
+      if (g_ecmp) {
+        route_set_port(&sw->routes, i, 0, -1, 0);
       }
     }
   }
-
-  // Update status of receivePort whether it's the tree or not
-  if (*packetSenderType == 'X') {
-    // packetSenderType is an endpoint
-    if (sw->localPortTree[receivePort] != YES) {
-      setLocalPortTreeState(sw, receivePort, YES);
+  if (expired) {
+    stpRecompute(sw);
+    if (g_ecmp) {
+      routeRecompute(sw);
     }
+  }
+}  // End of stpExpireNeighbors()
 
-  } else if (*packetSenderType == 'S') {
-    // packetSenderType is another switch
-    if (*packetIsSenderChild == 'Y') {
-      if (sw->localPortTree[receivePort] != YES) {
-        setLocalPortTreeState(sw, receivePort, YES);
-      }
-    } else {
-      // Tie-breaker: Prioritize lower node IDs when distances are equal
-      if (packetRootDist < sw->localRootDist ||
-          (packetRootDist == sw->localRootDist - 1 && pkt->src < sw->_id)) {
-        if (sw->localPortTree[receivePort] != YES) {
-          setLocalPortTreeState(sw, receivePort, YES);
-        }
-      } else {
-        if (sw->localPortTree[receivePort] != NO) {
-          setLocalPortTreeState(sw, receivePort, NO);
-        }
-      }
+/*
+Recomputes the shortest paths, and has them advertised this step if any
+changed.
+*/
+static void routeRecompute(struct SwitchNodeContext *sw) {
+  if (route_recompute(&sw->routes)) {
+    sw->routeUpdateDue = 1;
+  }
+}  // End of routeRecompute()
+
+/*
+Sends the switch's routes to the neighbor switch on port, in as many PKT_ROUTE
+packets as the link's MTU requires.
+*/
+static void routeSendToPort(struct SwitchNodeContext *sw, int port) {
+  struct Net_port *netPort = sw->node_port_array[port];
+  int next = 0;
+  while (next < sw->routes.numRoutes) {
+    struct Packet routePkt;
+    routePkt.src = sw->_id;
+    routePkt.dst = BROADCAST_ID;
+    routePkt.type = PKT_ROUTE;
+    routePkt.hops = 0;
+    routePkt.length = route_encode(&sw->routes, port, &next, routePkt.payload,
+                                   netPort->mtu);
+    if (routePkt.length == 0) {
+      break;
     }
-  } else {
-    // Catch all for any erroneous packetSenderType's
-    if (sw->localPortTree[receivePort] != NO) {
-      setLocalPortTreeState(sw, receivePort, NO);
+    packet_send(netPort, &routePkt);
+  }
+}  // End of routeSendToPort()
+
+/*
+Advertises the routes to every neighbor switch when they changed or a
+keepalive is due, and otherwise to the neighbors that were just heard from.
+*/
+static void routeSendUpdates(struct SwitchNodeContext *sw) {
+  int toAll = sw->routeUpdateDue || sw->stpUpdateDue;
+  for (int i = 0; i < sw->node_port_array_size; i++) {
+    struct StpNeighbor *nb = &sw->stpNeighbors[i];
+    if (nb->alive && nb->senderType == 'S' && (toAll || nb->replyDue)) {
+      routeSendToPort(sw, i);
     }
   }
-}  // End of handleControlPacket()
+  sw->routeUpdateDue = 0;
+}  // End of routeSendUpdates()
+
+/*
+Hashes the flow pkt belongs to: its source, destination and, for packets sent
+by a job, the job id at the start of the payload. Packets of one flow hash
+alike and so take the same path, which keeps them in order.
+*/
+static unsigned int ecmpFlowHash(const struct Packet *pkt) {
+  // FNV-1a
+  unsigned int hash = 2166136261u;
+  unsigned char key[8 + JIDLEN];
+  int keyLen = 8;
+  memcpy(key, &pkt->src, 4);
+  memcpy(key + 4, &pkt->dst, 4);
+  if (pkt->length >= JIDLEN) {
+    memcpy(key + 8, pkt->payload, JIDLEN);
+    keyLen += JIDLEN;
+  }
+  for (int i = 0; i < keyLen; i++) {
+    hash = (hash ^ key[i]) * 16777619u;
+  }
+  return hash;
+}  // End of ecmpFlowHash()
+
+void switch_use_ecmp() { g_ecmp = 1; }
 
 struct SwitchNodeContext *initSwitchNodeContext(int switch_id) {
   ////// Initialize state of switch //////
@@ -348,125 +667,186 @@ struct SwitchNodeContext *initSwitchNodeContext(int switch_id) {
     }
   }
 
-  /* Initialize the job queue */
-  sw->jobq = (struct JobQueue **)malloc(sizeof(struct JobQueue *));
-  *sw->jobq = (struct JobQueue *)malloc(sizeof(struct JobQueue));
-  job_queue_init(*sw->jobq);
-
-  ////// Initialize Router Table //////
-  sw->routingtable = (struct TableEntry **)malloc(sizeof(struct TableEntry *) *
-                                                  MAX_NUM_ROUTES);
-
-  for (int i = 0; i < MAX_NUM_ROUTES; i++) {
-    sw->routingtable[i] = NULL;
-  }
+  ////// Initialize forwarding table //////
+  fdb_init(&sw->fdb);
+  sw->nowMs = current_time_ms();
 
   ////// Initialize spanning tree variables //////
   sw->localRootID = switch_id;
   sw->localRootDist = 0;
   sw->localParentID = -1;
-  sw->localPortTree = malloc(sizeof(int) * (MAX_ADDRESS + 1));
-  for (int i = 0; i <= MAX_ADDRESS; i++) {
-    sw->localPortTree[i] = DEFAULT_TREE_STATE;
+  sw->stpNeighbors = (struct StpNeighbor *)calloc(
+      sw->node_port_array_size, sizeof(struct StpNeighbor));
+  sw->stpUpdateDue = 0;
+  route_table_init(&sw->routes, sw->node_port_array_size);
+  sw->routeUpdateDue = 0;
+  sw->treePorts = (uint64_t *)calloc(
+      (sw->node_port_array_size + TREE_PORT_BITS - 1) / TREE_PORT_BITS,
+      sizeof(uint64_t));
+  for (int i = 0; i < sw->node_port_array_size; i++) {
+    setLocalPortTreeState(sw, i, DEFAULT_TREE_STATE);
+  }
+
+  ////// Initialize packet pool //////
+  packet_pool_init(&sw->pktPool);
+
+#ifdef SWITCH_DEBUG_QUEUE
+  ////// Initialize queue drop reports //////
+  sw->reportedDrops = (unsigned long long *)calloc(
+      sw->node_port_array_size, sizeof(unsigned long long));
+  sw->lastQueueReportMs = sw->nowMs - SWITCH_QUEUE_REPORT_MS;
+#endif
+
+  ////// Initialize event loop //////
+  if (event_loop_init(&sw->loop) < 0) {
+    fprintf(stderr, "Error: Switch%d failed to create its event loop\n",
+            switch_id);
+    exit(EXIT_FAILURE);
+  }
+  for (int portNum = 0; portNum < sw->node_port_array_size; portNum++) {
+    event_loop_add_port(&sw->loop, sw->node_port_array[portNum], portNum);
   }
 
+  // First STP round goes out immediately, then a keepalive once per period
+  sw->numCtrlMsgsSent = 0;
+  event_loop_arm_timer(&sw->loop, 1, stp_hello_interval_ms());
+
   return sw;
 }  // End of initSwitchNodeContext()
 
+/* Sends the switch's STP state for round seq on port. */
+static void stpSendToPort(struct SwitchNodeContext *sw, int port,
+                          const char nodeType, unsigned int seq) {
+  struct Packet ctrlPkt;
+  ctrlPkt.src = sw->_id;
+  ctrlPkt.dst = BROADCAST_ID;
+  ctrlPkt.type = PKT_CONTROL;
+  ctrlPkt.hops = 0;
+  ctrlPkt.length = createTreePayload(
+      ctrlPkt.payload, sw->localRootID, sw->localRootDist, nodeType,
+      (sw->localParentID == port) ? 'Y' : 'N', seq);
+  packet_send(sw->node_port_array[port], &ctrlPkt);
+  sw->stpNeighbors[port].replyDue = 0;
+}  // End of stpSendToPort()
+
 void controlPacketSender_switch(struct SwitchNodeContext *sw,
                                 const char nodeType) {
   // For each connected port, create a STP control packet and send it
   for (int port = 0; port < sw->node_port_array_size; port++) {
-    // Create a STP packet payload
-    char ctrlPayload[PACKET_PAYLOAD_MAX];
-    int ctrlPayloadLen =
-        createTreePayload(ctrlPayload, sw->localRootID, sw->localRootDist,
-                          nodeType, (sw->localParentID == port) ? 'Y' : 'N');
-
-    struct Packet ctrlPkt;
-    ctrlPkt.src = sw->_id;
-    ctrlPkt.dst = 255;
-    ctrlPkt.type = PKT_CONTROL;
-    ctrlPkt.length = ctrlPayloadLen;
-    memcpy(ctrlPkt.payload, ctrlPayload, ctrlPayloadLen);
-    packet_send(sw->node_port_array[port], &ctrlPkt);
+    stpSendToPort(sw, port, nodeType, sw->numCtrlMsgsSent);
   }
-
+  sw->numCtrlMsgsSent++;
+  sw->stpUpdateDue = 0;
 }  // End of controlPacketSender_switch()
 
 void controlPacketSender_endpoint(int nodeId, struct Net_port **node_port_array,
-                                  int node_port_array_size) {
-  // Create a STP packet payload
-  char ctrlPayload[PACKET_PAYLOAD_MAX];
-  int ctrlPayloadLen =
-      createTreePayload(ctrlPayload, nodeId + 10000, 10000, 'X', 'N');
-  // Create a STP control packet
+                                  int node_port_array_size, unsigned int seq) {
+  // Create a STP control packet. The payload is binary, so it is encoded
+  // straight into the packet; switches ignore the root fields of endpoints,
+  // which never take part in root election
   struct Packet *ctrlPkt =
-      createPacket(nodeId, 255, PKT_CONTROL, ctrlPayloadLen, ctrlPayload);
+      createPacket(nodeId, BROADCAST_ID, PKT_CONTROL, 0, NULL);
+  ctrlPkt->length =
+      createTreePayload(ctrlPkt->payload, nodeId, 0, 'X', 'N', seq);
 
   // For each connected port
   for (int port = 0; port < node_port_array_size; port++) {
     packet_send(node_port_array[port], ctrlPkt);
-    packet_delete(ctrlPkt);
   }
+  packet_delete(ctrlPkt);
 
 }  // End of controlPacketSender_endpoint()
 
-// Searches the routing table for a matching valid TableEntry matching id
-// Returns routing table index of valid id, or -1 if unsuccessful
-//  **Note that routing table index is the port
-int searchRoutingTableForValidID(struct SwitchNodeContext *sw, int id,
-                                 int port) {
-#ifdef SWITCH_DEBUG_ROUTINGTABLE
-  char portMsg[100];
-  if (port == UNKNOWN) {
-    snprintf(portMsg, 100, "unknown port");
-  } else {
-    snprintf(portMsg, 100, "port%d", port);
+int controlPacketReceived_endpoint(int nodeId, struct Net_port *port,
+                                   const struct Packet *pkt,
+                                   unsigned int seq) {
+  struct StpMsg msg;
+  if (parseTreePayload(pkt, &msg) < 0 || msg.senderType != 'S' ||
+      msg.seq != 0) {
+    return 0;
   }
-  colorPrint(BLUE, "Switch%d: Searching routing table for host%d on %s\n",
-             sw->_id, id, portMsg);
-#endif
+  // The switch just started and may have missed our earlier packets
+  controlPacketSender_endpoint(nodeId, &port, 1, seq);
+  return 1;
+}  // End of controlPacketReceived_endpoint()
 
-  if (port == UNKNOWN) {
-    // Port was not given...
-    // Scan through the indices (ports) of the routing table
-    for (int i = 0; i < MAX_NUM_ROUTES; i++) {
-      // If there are entries for that port
-      if (sw->routingtable[i] != NULL) {
-        struct TableEntry *t = sw->routingtable[i];
-        while (t != NULL) {
-          if (t->id == id) {
-#ifdef SWITCH_DEBUG_ROUTINGTABLE
-            colorPrint(BLUE, "\tSwitch%d Found host%d on port%d\n", sw->_id, id,
-                       i);
-#endif
-            return i;
-          }
-          t = t->next;
-        }
+int stp_hello_interval_ms() {
+  // Within one simulation thread no link can be lost, and a periodic timer
+  // would keep the simulated clock running while nodes wait for the manager
+  return event_loop_virtual_time() ? 0 : STP_HELLO_MS;
+}  // End of stp_hello_interval_ms()
+
+/*
+Receives every packet waiting on portNum. Control packets are handled right
+away, and data packets are switched as they arrive: forwarded to the port
+their destination was learned on, or broadcast if it is unknown. Either way
+the packet only has to be copied into the output port's batch.
+*/
+void receiveFromPort(struct SwitchNodeContext *sw, int portNum) {
+  struct Net_port *port = sw->node_port_array[portNum];
+
+  while (1) {
+    struct Packet *inPkt = packet_pool_get(&sw->pktPool);
+    int n = packet_recv(port, inPkt);
+
+    if (n <= 0) {
+      // Port has been drained, so return packet to the pool
+      packet_delete(inPkt);
+      return;
+    }
+
+    if (inPkt->type == PKT_CONTROL) {
+      handleControlPacket(sw, portNum, inPkt);
+      packet_delete(inPkt);
+      continue;
+    }
+    if (inPkt->type == PKT_ROUTE) {
+      // Routes are only meant for the switch they were sent to
+      if (g_ecmp) {
+        route_receive(&sw->routes, portNum, inPkt->payload, inPkt->length);
+        routeRecompute(sw);
       }
+      packet_delete(inPkt);
+      continue;
     }
-  } else {
-    // Port was specified...
-    // Look in the routing table at that port for a matching id
-    if (sw->routingtable[port] != NULL) {
-      struct TableEntry *t = sw->routingtable[port];
-      while (t != NULL) {
-        if (t->id == id) {
-          return port;
+
+    // In ECMP mode a routed destination takes one of its shortest paths
+    int dstPort = g_ecmp ? route_next_hop(&sw->routes, inPkt->dst,
+                                          ecmpFlowHash(inPkt))
+                         : UNKNOWN;
+    if (!isTreePort(sw, portNum) && dstPort == UNKNOWN) {
+      // Data arriving on a port outside the spanning tree is a looped copy,
+      // unless it was routed here along a shortest path
+      packet_delete(inPkt);
+    } else if (++inPkt->hops > PACKET_MAX_HOPS) {
+      // Routes that are still converging can loop across several switches
+      packet_delete(inPkt);
+    } else {
+// incoming packet is not a control packet
+#ifdef SWITCH_DEBUG_PACKET_RECEIPT
+      colorPrint(BLUE, "Switch%d received packet: ", sw->_id);
+      printPacket(inPkt);
+#endif
+      // Learn where the sender is and look up where the destination is;
+      // only the spanning tree teaches reliable ports
+      if (isTreePort(sw, portNum)) {
+        int learnedPort =
+            fdb_learn_and_lookup(sw, inPkt->src, portNum, inPkt->dst);
+        if (dstPort == UNKNOWN) {
+          dstPort = learnedPort;
         }
-        t = t->next;
       }
+      if (dstPort == UNKNOWN) {
+        // destination of received packet is not in the forwarding table...
+        // broadcast packet to all connected hosts
+        broadcastToAllButSender(sw, inPkt, portNum);
+      } else {
+        packet_send(sw->node_port_array[dstPort], inPkt);
+      }
+      packet_delete(inPkt);
     }
   }
-
-#ifdef SWITCH_DEBUG_ROUTINGTABLE
-  colorPrint(BLUE, "\tUnable to find host%d in routing table\n", id);
-#endif
-
-  return -1;
-}  // End of searchRoutingTableForValidID()
+}  // End of receiveFromPort()
 
 int setLocalPortTreeState(struct SwitchNodeContext *sw, int portToSet,
                           int stateToSet) {
@@ -487,10 +867,17 @@ int setLocalPortTreeState(struct SwitchNodeContext *sw, int portToSet,
     return -1;
   }
 
-  sw->localPortTree[portToSet] = stateToSet;
+  uint64_t bit = (uint64_t)1 << (portToSet % TREE_PORT_BITS);
+  if (stateToSet == YES) {
+    sw->treePorts[portToSet / TREE_PORT_BITS] |= bit;
+  } else {
+    sw->treePorts[portToSet / TREE_PORT_BITS] &= ~bit;
+    // Nodes learned on the port are no longer reached through it
+    fdb_flush_port(&sw->fdb, portToSet);
+  }
 
 #ifdef SWITCH_DEBUG_CONTROL_UPDATE
-  colorPrint(c, "\tSwitch%d updating localPortTree[%d]=%s\n", sw->_id,
+  colorPrint(c, "\tSwitch%d updating tree port %d=%s\n", sw->_id,
              portToSet, stateLiteral);
 #endif
 }
@@ -0,0 +1,356 @@
+/*
+    uring.c
+*/
+
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "net.h"
+#include "packet.h"
+
+/*
+ * The ring is driven through the raw system calls so the static build does
+ * not need liburing. Every watched pipe keeps one multishot read armed: the
+ * kernel picks a buffer from the node's provided-buffer ring for each chunk it
+ * reads and keeps the read armed until the buffers run out. The bytes are
+ * appended to the port's packet stream buffer. Kernels without multishot
+ * reads (before 6.7) get a buffer-selecting read that is re-armed after every
+ * completion instead. Provided-buffer rings need 5.19 or newer;
+ * older kernels fail uring_create() and the node falls back to read()/write().
+ */
+
+// Not yet in every <linux/io_uring.h>
+#define URING_OP_READ_MULTISHOT 49
+
+#define URING_SQ_ENTRIES 256
+#define URING_BUFFER_GROUP 0
+
+// Completion user data: what finished in the high word, which in the low word
+#define URING_TAG_READ 1ULL
+#define URING_TAG_WRITE 2ULL
+#define URING_USER_DATA(tag, value) (((tag) << 32) | (unsigned int)(value))
+
+struct UringPort {
+  struct Net_port *port;  // Received bytes go to its stream buffer
+  int fd;
+  int watched;
+  int armed;   // A read is in flight
+  int closed;  // The writer went away or the read failed for good
+  int ready;   // Listed in readyPorts
+};
+
+struct Uring {
+  int fd;
+
+  // Submission queue, shared with the kernel
+  unsigned int *sqHead;
+  unsigned int *sqTail;
+  unsigned int *sqMask;
+  unsigned int *sqArray;
+  unsigned int sqEntries;
+  unsigned int sqLocalTail;  // Includes entries not yet published
+  struct io_uring_sqe *sqes;
+
+  // Completion queue, shared with the kernel
+  unsigned int *cqHead;
+  unsigned int *cqTail;
+  unsigned int *cqMask;
+  struct io_uring_cqe *cqes;
+
+  // Provided receive buffers
+  struct io_uring_buf_ring *bufRing;
+  char *rxBuffers;
+  unsigned short bufTail;
+  int multishot;
+
+  struct UringPort *ports;
+  int numPorts;
+  int *readyPorts;
+  int numReady;
+
+  char *txSlots;
+  struct Net_port *txPorts[URING_TX_SLOTS];  // Port each busy slot writes for
+  int txFree[URING_TX_SLOTS];
+  int numTxFree;
+};
+
+static int g_uring_enabled = 0;
+
+void uring_enable() { g_uring_enabled = 1; }
+
+int uring_enabled() { return g_uring_enabled; }
+
+// Hands receive buffer bid (back) to the kernel. The ring tail overlays the
+// reserved field of the first entry, so the fields are set one by one.
+static void uring_give_buffer(struct Uring *ring, int bid) {
+  struct io_uring_buf *buf =
+      &ring->bufRing->bufs[ring->bufTail & (URING_RX_BUFFERS - 1)];
+  buf->addr = (unsigned long)(ring->rxBuffers + bid * URING_RX_BUFFER_SIZE);
+  buf->len = URING_RX_BUFFER_SIZE;
+  buf->bid = bid;
+  ring->bufTail++;
+  __atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}  // End of uring_give_buffer()
+
+struct Uring *uring_create() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqSize =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sqSize = cqSize = (sqSize > cqSize) ? sqSize : cqSize;
+  }
+  char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  char *cq = sq;
+  if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, IORING_OFF_CQ_RING);
+  }
+  struct io_uring_sqe *sqes =
+      mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+           IORING_OFF_SQES);
+  struct io_uring_buf_ring *bufRing =
+      mmap(NULL, URING_RX_BUFFERS * sizeof(struct io_uring_buf),
+           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED ||
+      bufRing == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)bufRing;
+  reg.ring_entries = URING_RX_BUFFERS;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) <
+      0) {
+    close(fd);
+    return NULL;
+  }
+
+  struct Uring *ring = (struct Uring *)calloc(1, sizeof(struct Uring));
+  ring->fd = fd;
+  ring->sqHead = (unsigned int *)(sq + params.sq_off.head);
+  ring->sqTail = (unsigned int *)(sq + params.sq_off.tail);
+  ring->sqMask = (unsigned int *)(sq + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned int *)(sq + params.sq_off.array);
+  ring->sqEntries = params.sq_entries;
+  ring->sqLocalTail = *ring->sqTail;
+  ring->sqes = sqes;
+  ring->cqHead = (unsigned int *)(cq + params.cq_off.head);
+  ring->cqTail = (unsigned int *)(cq + params.cq_off.tail);
+  ring->cqMask = (unsigned int *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  ring->bufRing = bufRing;
+  ring->rxBuffers = (char *)malloc(URING_RX_BUFFERS * URING_RX_BUFFER_SIZE);
+  for (int bid = 0; bid < URING_RX_BUFFERS; bid++) {
+    uring_give_buffer(ring, bid);
+  }
+  ring->multishot = 1;
+
+  ring->txSlots = (char *)malloc(URING_TX_SLOTS * URING_TX_SLOT_SIZE);
+  for (int slot = 0; slot < URING_TX_SLOTS; slot++) {
+    ring->txFree[slot] = slot;
+  }
+  ring->numTxFree = URING_TX_SLOTS;
+  return ring;
+}  // End of uring_create()
+
+int uring_fd(struct Uring *ring) { return ring->fd; }
+
+// Returns the next free submission entry, cleared, or NULL if the queue is
+// still full after a flush
+static struct io_uring_sqe *uring_get_sqe(struct Uring *ring) {
+  if (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >=
+      ring->sqEntries) {
+    uring_flush(ring);
+    if (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >=
+        ring->sqEntries) {
+      return NULL;
+    }
+  }
+  unsigned int index = ring->sqLocalTail & *ring->sqMask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sqArray[index] = index;
+  ring->sqLocalTail++;
+  return sqe;
+}  // End of uring_get_sqe()
+
+static void uring_arm_read(struct Uring *ring, int index) {
+  struct UringPort *p = &ring->ports[index];
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL) {
+    // Left disarmed; the next uring_reap() tries again
+    return;
+  }
+  sqe->opcode = ring->multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ;
+  sqe->fd = p->fd;
+  sqe->off = (unsigned long long)-1;
+  sqe->len = ring->multishot ? 0 : URING_RX_BUFFER_SIZE;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = URING_USER_DATA(URING_TAG_READ, index);
+  p->armed = 1;
+}  // End of uring_arm_read()
+
+int uring_watch_port(struct Uring *ring, struct Net_port *port, int index) {
+  if (port->type != PIPE) {
+    return -1;
+  }
+
+  if (index >= ring->numPorts) {
+    int numPorts = index + 1;
+    ring->ports = (struct UringPort *)realloc(
+        ring->ports, numPorts * sizeof(struct UringPort));
+    memset(&ring->ports[ring->numPorts], 0,
+           (numPorts - ring->numPorts) * sizeof(struct UringPort));
+    ring->readyPorts =
+        (int *)realloc(ring->readyPorts, numPorts * sizeof(int));
+    ring->numPorts = numPorts;
+  }
+
+  struct UringPort *p = &ring->ports[index];
+  p->port = port;
+  p->fd = port->recv_fd;
+  p->watched = 1;
+
+  // Reads now only come from the ring, which waits for data by itself
+  fcntl(p->fd, F_SETFL, fcntl(p->fd, F_GETFL) & ~O_NONBLOCK);
+
+  port->ring = ring;
+  port->ringIndex = index;
+  uring_arm_read(ring, index);
+  return 0;
+}  // End of uring_watch_port()
+
+void uring_flush(struct Uring *ring) {
+  unsigned int toSubmit =
+      ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (toSubmit == 0) {
+    return;
+  }
+  __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+  while (syscall(__NR_io_uring_enter, ring->fd, toSubmit, 0, 0, NULL, 0) < 0 &&
+         errno == EINTR) {
+  }
+}  // End of uring_flush()
+
+int uring_queue_write(struct Uring *ring, struct Net_port *port,
+                      const char *buf, int len) {
+  struct io_uring_sqe *sqe = NULL;
+  if (len <= URING_TX_SLOT_SIZE) {
+    if (ring->numTxFree == 0) {
+      // Slots come back with their completions
+      uring_flush(ring);
+      uring_reap(ring, NULL, 0);
+    }
+    if (ring->numTxFree > 0) {
+      sqe = uring_get_sqe(ring);
+    }
+  }
+  if (sqe == NULL) {
+    // Whatever is queued must go out before the caller's own write()
+    uring_flush(ring);
+    return -1;
+  }
+
+  int slot = ring->txFree[--ring->numTxFree];
+  memcpy(ring->txSlots + slot * URING_TX_SLOT_SIZE, buf, len);
+  ring->txPorts[slot] = port;
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = port->send_fd;
+  sqe->addr = (unsigned long)(ring->txSlots + slot * URING_TX_SLOT_SIZE);
+  sqe->len = len;
+  sqe->off = (unsigned long long)-1;
+  sqe->user_data = URING_USER_DATA(URING_TAG_WRITE, slot);
+  return 0;
+}  // End of uring_queue_write()
+
+static void uring_handle_cqe(struct Uring *ring, struct io_uring_cqe *cqe) {
+  unsigned long long tag = cqe->user_data >> 32;
+  int value = (int)(unsigned int)cqe->user_data;
+
+  if (tag == URING_TAG_WRITE) {
+    ring->txFree[ring->numTxFree++] = value;
+    packet_write_done(ring->txPorts[value], cqe->res);
+    return;
+  }
+
+  struct UringPort *p = &ring->ports[value];
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res > 0) {
+      packet_stream_append(
+          p->port, ring->rxBuffers + bid * URING_RX_BUFFER_SIZE, cqe->res);
+    }
+    uring_give_buffer(ring, bid);
+  }
+  if (cqe->res > 0 && !p->ready) {
+    p->ready = 1;
+    ring->readyPorts[ring->numReady++] = value;
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    p->armed = 0;
+    if (cqe->res == -EINVAL && ring->multishot) {
+      // Kernel without multishot reads; re-arm one read at a time
+      ring->multishot = 0;
+    } else if (cqe->res == 0) {
+      p->closed = 1;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EAGAIN &&
+               cqe->res != -EINTR) {
+      fprintf(stderr, "\nError: uring: read on pipe %d failed: %s\n", p->fd,
+              strerror(-cqe->res));
+      p->closed = 1;
+    }
+  }
+}  // End of uring_handle_cqe()
+
+int uring_reap(struct Uring *ring, int *ports, int max) {
+  unsigned int head = *ring->cqHead;
+  unsigned int tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    uring_handle_cqe(ring, &ring->cqes[head & *ring->cqMask]);
+    head++;
+  }
+  __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+  for (int i = 0; i < ring->numPorts; i++) {
+    struct UringPort *p = &ring->ports[i];
+    if (p->watched && !p->armed && !p->closed) {
+      uring_arm_read(ring, i);
+    }
+  }
+
+  int n = (ring->numReady < max) ? ring->numReady : max;
+  for (int i = 0; i < n; i++) {
+    ports[i] = ring->readyPorts[i];
+    ring->ports[ports[i]].ready = 0;
+  }
+  memmove(ring->readyPorts, ring->readyPorts + n,
+          (ring->numReady - n) * sizeof(int));
+  ring->numReady -= n;
+  return n;
+}  // End of uring_reap()
+
+int uring_has_ready(struct Uring *ring) { return ring->numReady > 0; }